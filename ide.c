@@ -25,6 +25,9 @@
 #include <errno.h>
 #include <time.h>
 #include <arpa/inet.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 
 #include "ide.h"
 
@@ -70,12 +73,19 @@
 #define IDE_CMD_SEEK		0x70
 #define IDE_CMD_EDD		0x90
 #define IDE_CMD_INTPARAMS	0x91
+#define IDE_CMD_READ_MULTI	0xC4
+#define IDE_CMD_WRITE_MULTI	0xC5
+#define IDE_CMD_SET_MULTI	0xC6
+#define IDE_CMD_FLUSH_CACHE	0xE7
 #define IDE_CMD_IDENTIFY	0xEC
 #define IDE_CMD_SETFEATURES	0xEF
 
 const uint8_t ide_magic[8] = {
   '1','D','E','D','1','5','C','0'
 };
+const uint8_t ide_sparse_magic[8] = {
+  '1','D','E','D','5','P','A','0'
+};
 
 #if 0
 
@@ -117,6 +127,12 @@ static uint16_t le16(uint16_t v)
   return p[0] | (p[1] << 8);
 }
 
+static uint32_t le32(uint32_t v)
+{
+  uint8_t *p = (uint8_t *)&v;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
 static void ide_xlate_errno(struct ide_taskfile *t, int len)
 {
   t->status |= ST_ERR;
@@ -135,6 +151,441 @@ static void ide_fault(struct ide_drive *d, const char *p)
 			(int)(d - d->controller->drive), p);
 }
 
+/*
+ *	Sparse images. Sector 0 is the header, sector 1 the identify block
+ *	as usual, then comes an index with an entry per block of sectors
+ *	and finally the data blocks in the order they were first written.
+ *	An index entry of 0 means the block reads as 0xE5, one with the top
+ *	bit set a block filled with the low byte, anything else the data
+ *	block number counting from 1. Blocks are allocated on the first
+ *	write that does not fill them with a single value.
+ */
+#define SPARSE_FILL	0x80000000U
+
+static uint8_t sparse_buf[512 * IDE_SPARSE_BLOCK];
+
+static void sparse_fill(uint8_t *p, uint32_t e, int n)
+{
+  memset(p, e ? e & 0xFF : 0xE5, 512 * n);
+}
+
+/* Check if a block holds a single value and if so give its entry */
+static int sparse_uniform(const uint8_t *p, uint32_t *e)
+{
+  int i;
+  for (i = 1; i < 512 * IDE_SPARSE_BLOCK; i++)
+    if (p[i] != p[0])
+      return 0;
+  *e = p[0] == 0xE5 ? 0 : SPARSE_FILL | p[0];
+  return 1;
+}
+
+static int sparse_set(struct ide_drive *d, uint32_t blk, uint32_t e)
+{
+  uint32_t v = le32(e);
+  d->sparse[blk] = e;
+  if (pwrite(d->fd, &v, 4, 1024 + 4 * blk) != 4)
+    return -1;
+  return 0;
+}
+
+/* Read or write sectors of the image itself, below any overlay */
+static ssize_t image_read(struct ide_drive *d, uint8_t *buf, int n, off_t sector)
+{
+  ssize_t len, total = 0;
+  uint32_t blk, e;
+  int in, run;
+
+  if (d->sparse == NULL)
+    return pread(d->fd, buf, 512 * n, 512 * sector);
+  while (n && sector < d->sp_total) {
+    if (sector < 2) {
+      /* The header and identify blocks are stored as is */
+      len = pread(d->fd, buf, 512, 512 * sector);
+      run = 1;
+    } else {
+      blk = (sector - 2) / IDE_SPARSE_BLOCK;
+      in = (sector - 2) % IDE_SPARSE_BLOCK;
+      run = IDE_SPARSE_BLOCK - in;
+      if (run > n)
+        run = n;
+      if (run > d->sp_total - sector)
+        run = d->sp_total - sector;
+      e = d->sparse[blk];
+      if (e == 0 || (e & SPARSE_FILL)) {
+        sparse_fill(buf, e, run);
+        len = 512 * run;
+      } else
+        len = pread(d->fd, buf, 512 * run,
+          512 * (d->sp_data + (off_t)(e - 1) * IDE_SPARSE_BLOCK + in));
+    }
+    if (len < 0)
+      return total ? total : -1;
+    total += len;
+    if (len < 512 * run)
+      break;
+    buf += len;
+    sector += run;
+    n -= run;
+  }
+  return total;
+}
+
+static ssize_t image_write(struct ide_drive *d, uint8_t *buf, int n, off_t sector)
+{
+  ssize_t total = 0;
+  uint32_t blk, e;
+  off_t pos;
+  int in, run;
+
+  if (d->sparse == NULL)
+    return pwrite(d->fd, buf, 512 * n, 512 * sector);
+  while (n) {
+    if (sector < 2 || sector >= d->sp_total) {
+      errno = ENOSPC;
+      return total ? total : -1;
+    }
+    blk = (sector - 2) / IDE_SPARSE_BLOCK;
+    in = (sector - 2) % IDE_SPARSE_BLOCK;
+    run = IDE_SPARSE_BLOCK - in;
+    if (run > n)
+      run = n;
+    e = d->sparse[blk];
+    if (e && !(e & SPARSE_FILL)) {
+      pos = d->sp_data + (off_t)(e - 1) * IDE_SPARSE_BLOCK + in;
+      if (pwrite(d->fd, buf, 512 * run, 512 * pos) != 512 * run)
+        return total ? total : -1;
+    } else {
+      /* Merge into the fill pattern. If the result is still a single
+         value we just change the index, otherwise allocate a block */
+      sparse_fill(sparse_buf, e, IDE_SPARSE_BLOCK);
+      memcpy(sparse_buf + 512 * in, buf, 512 * run);
+      if (sparse_uniform(sparse_buf, &e)) {
+        if (e != d->sparse[blk] && sparse_set(d, blk, e) < 0)
+          return total ? total : -1;
+      } else {
+        e = d->sp_next;
+        pos = d->sp_data + (off_t)(e - 1) * IDE_SPARSE_BLOCK;
+        if (pwrite(d->fd, sparse_buf, sizeof(sparse_buf), 512 * pos) != sizeof(sparse_buf))
+          return total ? total : -1;
+        /* Data first so a crash never leaves the index pointing at junk */
+        d->sp_next++;
+        if (sparse_set(d, blk, e) < 0)
+          return total ? total : -1;
+      }
+    }
+    total += 512 * run;
+    buf += 512 * run;
+    sector += run;
+    n -= run;
+  }
+  return total;
+}
+
+static off_t image_sectors(struct ide_drive *d)
+{
+  struct stat st;
+  if (d->sparse)
+    return d->sp_total;
+  if (fstat(d->fd, &st) == -1)
+    return -1;
+  return st.st_size / 512;
+}
+
+/*
+ *	Copy on write overlays. The overlay file holds a header sector, a
+ *	bitmap of which sectors have been written and then the written
+ *	sectors at their own offsets (so the file is sparse). Anything not
+ *	in the bitmap comes from the base image, which is never written.
+ *	The bitmap is only written back on FLUSH CACHE or detach.
+ */
+static const uint8_t cow_magic[8] = {
+  '1','D','E','D','C','0','W','0'
+};
+
+static int cow_test(struct ide_drive *d, off_t sector)
+{
+  if (sector >= d->cowsectors)
+    return 0;
+  return d->cow[sector >> 3] & (1 << (sector & 7));
+}
+
+static int cow_sync(struct ide_drive *d)
+{
+  off_t len = (d->cowdata - 1) * 512;
+  if (!d->cowdirty)
+    return 0;
+  if (pwrite(d->cowfd, d->cow, len, 512) != len) {
+    ide_fault(d, "overlay bitmap write failed");
+    return -1;
+  }
+  d->cowdirty = 0;
+  return 0;
+}
+
+/* All sector I/O to the host goes through these two */
+static ssize_t disk_read(struct ide_drive *d, uint8_t *buf, int n, off_t sector)
+{
+  ssize_t len, total = 0;
+  int run, cow;
+
+  if (d->cow == NULL)
+    return image_read(d, buf, n, sector);
+  /* Split the range into runs from the overlay or the base */
+  while (n) {
+    cow = cow_test(d, sector);
+    for (run = 1; run < n && !cow_test(d, sector + run) == !cow; run++);
+    if (cow)
+      len = pread(d->cowfd, buf, 512 * run, 512 * (d->cowdata + sector));
+    else
+      len = image_read(d, buf, run, sector);
+    if (len < 0)
+      return total ? total : -1;
+    total += len;
+    if (len < 512 * run)
+      break;
+    buf += len;
+    sector += run;
+    n -= run;
+  }
+  return total;
+}
+
+static ssize_t disk_write(struct ide_drive *d, uint8_t *buf, int n, off_t sector)
+{
+  ssize_t len;
+
+  if (d->cow == NULL)
+    return image_write(d, buf, n, sector);
+  if (sector + n > d->cowsectors) {
+    errno = ENOSPC;
+    return -1;
+  }
+  len = pwrite(d->cowfd, buf, 512 * n, 512 * (d->cowdata + sector));
+  if (len != 512 * n)
+    return len;
+  d->cowdirty = 1;
+  while (n--) {
+    d->cow[sector >> 3] |= 1 << (sector & 7);
+    sector++;
+  }
+  return len;
+}
+
+/*
+ *	Sector cache shared by all drives. Sectors are hashed on the drive
+ *	and sector number and kept on an LRU list. In write back mode dirty
+ *	sectors go to the image when evicted, on FLUSH CACHE or on detach.
+ */
+struct ide_cent {
+  struct ide_drive *drive;
+  off_t sector;
+  struct ide_cent *hnext;
+  struct ide_cent *prev, *next;	/* LRU list, most recent first */
+  int dirty;
+  uint8_t data[512];
+};
+
+static struct ide_cent *cache;
+static struct ide_cent **cache_hash;
+static struct ide_cent *cache_free;
+static struct ide_cent *lru_head, *lru_tail;
+static unsigned int cache_mask;
+static int cache_writeback;
+static unsigned long cache_hits, cache_misses;
+
+static unsigned int cache_hashfn(struct ide_drive *d, off_t sector)
+{
+  return ((uint32_t)sector * 2654435761U ^ (uintptr_t)d >> 4) & cache_mask;
+}
+
+static void lru_unlink(struct ide_cent *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    lru_head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+}
+
+static void lru_push(struct ide_cent *e)
+{
+  e->prev = NULL;
+  e->next = lru_head;
+  if (lru_head)
+    lru_head->prev = e;
+  else
+    lru_tail = e;
+  lru_head = e;
+}
+
+static struct ide_cent *cache_find(struct ide_drive *d, off_t sector)
+{
+  struct ide_cent *e = cache_hash[cache_hashfn(d, sector)];
+  while (e && (e->drive != d || e->sector != sector))
+    e = e->hnext;
+  return e;
+}
+
+static void cache_unhash(struct ide_cent *e)
+{
+  struct ide_cent **p = &cache_hash[cache_hashfn(e->drive, e->sector)];
+  while (*p != e)
+    p = &(*p)->hnext;
+  *p = e->hnext;
+}
+
+static int cache_writeout(struct ide_cent *e)
+{
+  if (disk_write(e->drive, e->data, 1, e->sector) != 512) {
+    ide_fault(e->drive, "cache write back failed");
+    return -1;
+  }
+  e->dirty = 0;
+  return 0;
+}
+
+/* Find or allocate the entry for a sector, making it most recent. A
+   dirty sector that cannot be written back is kept and the next oldest
+   tried instead. Returns NULL if nothing can be freed */
+static struct ide_cent *cache_get(struct ide_drive *d, off_t sector)
+{
+  struct ide_cent *e = cache_find(d, sector);
+  unsigned int h;
+
+  if (e) {
+    lru_unlink(e);
+    lru_push(e);
+    return e;
+  }
+  if (cache_free) {
+    e = cache_free;
+    cache_free = e->next;
+  } else {
+    for (e = lru_tail; e; e = e->prev)
+      if (!e->dirty || cache_writeout(e) == 0)
+        break;
+    if (e == NULL)
+      return NULL;
+    lru_unlink(e);
+    cache_unhash(e);
+  }
+  e->drive = d;
+  e->sector = sector;
+  e->dirty = 0;
+  h = cache_hashfn(d, sector);
+  e->hnext = cache_hash[h];
+  cache_hash[h] = e;
+  lru_push(e);
+  return e;
+}
+
+/* Write back the dirty sectors of a drive, and forget them if asked.
+   Sectors that could not be written back are always kept */
+static int cache_flush(struct ide_drive *d, int drop)
+{
+  struct ide_cent *e, *n;
+  int r = 0;
+
+  for (e = lru_head; e; e = n) {
+    n = e->next;
+    if (e->drive != d)
+      continue;
+    if (e->dirty && cache_writeout(e) < 0) {
+      r = -1;
+      continue;
+    }
+    if (drop) {
+      lru_unlink(e);
+      cache_unhash(e);
+      e->next = cache_free;
+      cache_free = e;
+    }
+  }
+  return r;
+}
+
+/* Read up to n sectors from sector onwards into buf. Only the first need
+   are required, the rest are read ahead and skipped if the needed part
+   is already cached. Returns the number of sectors read or -1 */
+static int ide_pread(struct ide_drive *d, uint8_t *buf, int need, int n, off_t sector)
+{
+  struct ide_cent *e;
+  ssize_t len;
+  int i, j, got;
+
+  if (cache == NULL) {
+    len = disk_read(d, buf, n, sector);
+    return len < 0 ? -1 : len / 512;
+  }
+  for (i = 0; i < n; i++) {
+    e = cache_find(d, sector + i);
+    if (e == NULL)
+      break;
+    memcpy(buf + 512 * i, e->data, 512);
+    lru_unlink(e);
+    lru_push(e);
+    cache_hits++;
+  }
+  if (i >= need)
+    return i;
+  /* Fetch the rest in one go, but anything cached (and maybe dirty)
+     wins over what is on disk */
+  len = disk_read(d, buf + 512 * i, n - i, sector + i);
+  if (len < 0)
+    return -1;
+  got = i + len / 512;
+  /* Overlay everything first, as filling the misses may evict (and
+     write back) dirty sectors further along */
+  for (j = i; j < got; j++) {
+    e = cache_find(d, sector + j);
+    if (e)
+      memcpy(buf + 512 * j, e->data, 512);
+  }
+  for (; i < got; i++) {
+    if (cache_find(d, sector + i)) {
+      cache_hits++;
+      continue;
+    }
+    /* Nothing to spare, the data is still good just not cached */
+    e = cache_get(d, sector + i);
+    if (e == NULL)
+      break;
+    memcpy(e->data, buf + 512 * i, 512);
+    cache_misses++;
+  }
+  return got;
+}
+
+/* Write n sectors. In write back mode they only go to the cache */
+static int ide_pwrite(struct ide_drive *d, uint8_t *buf, int n, off_t sector)
+{
+  struct ide_cent *e;
+  int i;
+
+  if (cache == NULL || !cache_writeback) {
+    if (disk_write(d, buf, n, sector) != 512 * n)
+      return -1;
+  }
+  if (cache) {
+    for (i = 0; i < n; i++) {
+      e = cache_get(d, sector + i);
+      if (e == NULL) {
+        /* Without a place to keep it a write back sector is lost */
+        if (cache_writeback)
+          return -1;
+        continue;
+      }
+      memcpy(e->data, buf + 512 * i, 512);
+      e->dirty = cache_writeback;
+    }
+  }
+  return n;
+}
+
 /* Disk translation */
 static off_t xlate_block(struct ide_taskfile *t)
 {
@@ -142,11 +593,40 @@ static off_t xlate_block(struct ide_taskfile *t)
   if (t->lba4 & DEVH_LBA) {
 /*    fprintf(stderr, "XLATE LBA %02X:%02X:%02X:%02X\n", 
       t->lba4, t->lba3, t->lba2, t->lba1);*/
-    if (d->lba)
-      return 2 + (((t->lba4 & DEVH_HEAD) << 24) | (t->lba3 << 16) | (t->lba2 << 8) | t->lba1);
+    if (d->lba) {
+      uint32_t lba = ((uint32_t)(t->lba4 & DEVH_HEAD) << 24) | (t->lba3 << 16) | (t->lba2 << 8) | t->lba1;
+      if (lba >= d->capacity)
+        return -1;
+      return 2 + (off_t)lba;
+    }
     ide_fault(d, "LBA on non LBA drive");
   }
-  return 2 + (((t->lba4 & DEVH_HEAD) * d->cylinders + ((t->lba3 << 8) + t->lba2)) * d->sectors + t->lba1);
+  if ((t->lba4 & DEVH_HEAD) >= d->heads || ((t->lba3 << 8) + t->lba2) >= d->cylinders ||
+      t->lba1 == 0 || t->lba1 > d->sectors)
+    return -1;
+  return 2 + ((off_t)(t->lba4 & DEVH_HEAD) * d->cylinders + ((t->lba3 << 8) + t->lba2)) * d->sectors + t->lba1;
+}
+
+/* Size the next DRQ block: one sector, or up to the multiple count for
+   READ/WRITE MULTIPLE */
+static void next_block(struct ide_drive *d)
+{
+  d->nsect = d->length < d->block ? d->length : d->block;
+}
+
+/* Point the data window at the current block of a mapped image. The
+   guest then reads and writes the image directly */
+static int ide_map_block(struct ide_drive *d)
+{
+  if (512 * (d->offset + d->nsect) > d->mapsize) {
+    d->taskfile.status |= ST_ERR;
+    d->taskfile.status &= ~ST_DSC;
+    d->taskfile.error = ERR_IDNF;
+    return -1;
+  }
+  d->dptr = d->map + 512 * d->offset;
+  d->dend = d->dptr + 512 * d->nsect;
+  return 0;
 }
 
 /* Indicate the drive is ready */
@@ -176,6 +656,7 @@ static void data_in_state(struct ide_taskfile *tf)
   struct ide_drive *d = tf->drive;
   d->state = IDE_DATA_IN;
   d->dptr = d->data + 512;
+  d->dend = d->dptr;
   /* We don't clear DRDY here, drives may well accept a command at this
      point and at least one firmware for RC2014 assumes this */
   tf->status &= ~ST_BSY;
@@ -187,7 +668,13 @@ static void data_out_state(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
   d->state = IDE_DATA_OUT;
-  d->dptr = d->data;
+  next_block(d);
+  /* Writes are gathered and go to the image when the command completes.
+     This also discards any staged read data */
+  d->xoff = d->offset;
+  d->xcount = 0;
+  d->dptr = d->xfer;
+  d->dend = d->xfer + 512 * d->nsect;
   tf->status &= ~ (ST_BSY|ST_DRDY);
   tf->status |= ST_DRQ;
   d->intrq = 1;			/* Double check */
@@ -264,14 +751,17 @@ static void cmd_identify_complete(struct ide_taskfile *tf)
   data_in_state(tf);
   /* Arrange to copy just the identify buffer */
   d->dptr = d->data;
+  d->dend = d->data + 512;
   d->length = 1;
+  d->nsect = 1;
 }
 
 static void cmd_initparam_complete(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
-  /* We only support the current mapping */
-  if (tf->count != d->sectors || (tf->lba4 & DEVH_HEAD) != d->heads) {
+  /* We only support the current mapping. The head field is the highest
+     head number, not the count */
+  if (tf->count != d->sectors || (tf->lba4 & DEVH_HEAD) + 1 != d->heads) {
     tf->status |= ST_ERR;
     tf->error |= ERR_ABRT;
     tf->drive->failed = 1;		/* Report ID NF until fixed */
@@ -297,7 +787,7 @@ static void cmd_readsectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
   /* fprintf(stderr, "READ %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1) {
     tf->status |= ST_ERR;
     tf->status &= ~ST_DSC;
     tf->error |= ERR_IDNF;
@@ -320,7 +810,17 @@ static void cmd_verifysectors_complete(struct ide_taskfile *tf)
   d->offset = xlate_block(tf);
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
-  if (lseek(d->fd, 512 * (d->offset + d->length - 1), SEEK_SET) == -1) {
+  if (d->offset == -1) {
+    tf->status &= ~ST_DSC;
+    tf->status |= ST_ERR;
+    tf->error |= ERR_IDNF;
+  } else if (d->map) {
+    if (512 * (d->offset + d->length) > d->mapsize) {
+      tf->status &= ~ST_DSC;
+      tf->status |= ST_ERR;
+      tf->error |= ERR_IDNF;
+    }
+  } else if (lseek(d->fd, 512 * (d->offset + d->length - 1), SEEK_SET) == -1) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -349,7 +849,7 @@ static void cmd_seek_complete(struct ide_taskfile *tf)
   if (d->failed)
     drive_failed(tf);
   d->offset = xlate_block(tf);
-  if (d->offset == -1 || lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1 || (!d->map && lseek(d->fd, 512 * d->offset, SEEK_SET) == -1)) {
     tf->status &= ~ST_DSC;
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
@@ -382,6 +882,56 @@ static void cmd_setfeatures_complete(struct ide_taskfile *tf)
   completed(tf);
 }
 
+/* Get everything written so far onto the image */
+static int drive_flush(struct ide_drive *d)
+{
+  if (d->map)
+    return msync(d->map, d->mapsize, MS_SYNC);
+  if (cache && cache_flush(d, 0) < 0)
+    return -1;
+  if (d->cow)
+    return cow_sync(d) < 0 ? -1 : fsync(d->cowfd);
+  return fsync(d->fd);
+}
+
+static void cmd_flushcache_complete(struct ide_taskfile *tf)
+{
+  if (drive_flush(tf->drive) == -1) {
+    tf->status |= ST_ERR;
+    tf->error |= ERR_ABRT;
+  }
+  completed(tf);
+}
+
+static void cmd_setmulti_complete(struct ide_taskfile *tf)
+{
+  struct ide_drive *d = tf->drive;
+  /* 0 disables, otherwise a power of two up to our maximum */
+  if (tf->count > IDE_MAX_MULTI || (tf->count & (tf->count - 1))) {
+    tf->status |= ST_ERR;
+    tf->error |= ERR_ABRT;
+  } else {
+    d->multi = tf->count;
+    d->identify[59] = le16(d->multi ? 0x0100 | d->multi : 0);
+  }
+  completed(tf);
+}
+
+/* READ/WRITE MULTIPLE transfer a block of sectors per DRQ and are only
+   valid once SET MULTIPLE has been issued */
+static int multi_setup(struct ide_taskfile *tf)
+{
+  struct ide_drive *d = tf->drive;
+  if (d->multi == 0) {
+    tf->status |= ST_ERR;
+    tf->error |= ERR_ABRT;
+    completed(tf);
+    return 0;
+  }
+  d->block = d->multi;
+  return 1;
+}
+
 static void cmd_writesectors_complete(struct ide_taskfile *tf)
 {
   struct ide_drive *d = tf->drive;
@@ -395,7 +945,7 @@ static void cmd_writesectors_complete(struct ide_taskfile *tf)
   /* 0 = 256 sectors */
   d->length = tf->count ? tf->count : 256;
 /*  fprintf(stderr, "WRITE %d SECTORS @ %ld\n", d->length, d->offset); */
-  if (d->offset == -1 ||  lseek(d->fd, 512 * d->offset, SEEK_SET) == -1) {
+  if (d->offset == -1) {
     tf->status |= ST_ERR;
     tf->error |= ERR_IDNF;
     tf->status &= ~ST_DSC;
@@ -405,6 +955,8 @@ static void cmd_writesectors_complete(struct ide_taskfile *tf)
   }
   /* do the xfer */
   data_out_state(tf);
+  if (d->map && ide_map_block(d) < 0)
+    completed(tf);
 }
 
 static void ide_set_error(struct ide_drive *d)
@@ -430,36 +982,59 @@ static void ide_set_error(struct ide_drive *d)
   completed(&d->taskfile);
 }
 
-static int ide_read_sector(struct ide_drive *d)
+/* Point the data window at the next block. Reads are staged in xfer:
+   when the block is not already there we fetch the rest of the command
+   (or the read ahead window if larger) with a single pread */
+static int ide_read_block(struct ide_drive *d)
 {
-  int len;
-
-  d->dptr = d->data;
-  if ((len = read(d->fd, d->data, 512)) != 512) {
-    perror("ide_read_sector");
-    d->taskfile.status |= ST_ERR;
-    d->taskfile.status &= ~ST_DSC;
-    ide_xlate_errno(&d->taskfile, len);
-    return -1;
+  int n, got;
+
+  next_block(d);
+  if (d->map)
+    return ide_map_block(d);
+  if (d->offset < d->xoff || d->offset + d->nsect > d->xoff + d->xcount) {
+    n = d->length > d->readahead ? d->length : d->readahead;
+    if (n > IDE_XFER_MAX)
+      n = IDE_XFER_MAX;
+    d->xoff = d->offset;
+    d->xcount = 0;
+    got = ide_pread(d, d->xfer, d->length, n, d->offset);
+    if (got < d->nsect) {
+      perror("ide_read_block");
+      d->taskfile.status |= ST_ERR;
+      d->taskfile.status &= ~ST_DSC;
+      ide_xlate_errno(&d->taskfile, got);
+      return -1;
+    }
+    /* A short read near the end of the image is fine if it covers
+       this block */
+    d->xcount = got;
   }
-//  hexdump(d->data);
-  d->offset += 512;
+  d->dptr = d->xfer + 512 * (d->offset - d->xoff);
+  d->dend = d->dptr + 512 * d->nsect;
+//  hexdump(d->dptr);
   return 0;
 }
 
-static int ide_write_sector(struct ide_drive *d)
+/* Write out everything gathered for this command */
+static int ide_write_block(struct ide_drive *d)
 {
   int len;
+  int n = d->offset - d->xoff;
 
-  d->dptr = d->data;
-  if ((len = write(d->fd, d->data, 512)) != 512) {
+  /* A mapped block is already in the image */
+  if (d->map)
+    return 0;
+  if ((len = ide_pwrite(d, d->xfer, n, d->xoff)) != n) {
     d->taskfile.status |= ST_ERR;
     d->taskfile.status &= ~ST_DSC;
     ide_xlate_errno(&d->taskfile, len);
+    /* Report the batch as failed from its first sector */
+    d->length = n;
+    d->offset = d->xoff;
     return -1;
   }
-//  hexdump(d->data);
-  d->offset += 512;
+//  hexdump(d->xfer);
   return 0;
 }
 
@@ -467,8 +1042,8 @@ static uint16_t ide_data_in(struct ide_drive *d, int len)
 {
   uint16_t v;
   if (d->state == IDE_DATA_IN) {
-    if (d->dptr == d->data + 512) {
-      if (ide_read_sector(d) < 0) {
+    if (d->dptr == d->dend) {
+      if (ide_read_block(d) < 0) {
         ide_set_error(d);	/* Set the LBA or CHS etc */
         return 0xFFFF;		/* and error bits set by read_sector */
       }
@@ -481,9 +1056,11 @@ static uint16_t ide_data_in(struct ide_drive *d, int len)
     } else
       d->dptr++;
     d->taskfile.data = v;
-    if (d->dptr == d->data + 512) {
-      d->length--;
-      d->intrq = 1;		/* we don't yet emulate multimode */
+    if (d->dptr == d->dend) {
+      /* One interrupt per DRQ block */
+      d->offset += d->nsect;
+      d->length -= d->nsect;
+      d->intrq = 1;
       if (d->length == 0) {
         d->state = IDE_IDLE;
         completed(&d->taskfile);
@@ -511,18 +1088,25 @@ static void ide_data_out(struct ide_drive *d, uint16_t v, int len)
       *d->dptr++ = v >> 8;
       d->taskfile.data = v >> 8;
     }
-    if (d->dptr == d->data + 512) {
-      if (ide_write_sector(d) < 0) {
-        ide_set_error(d);
-        return;	
-      }
-      d->length--;
+    if (d->dptr == d->dend) {
+      d->offset += d->nsect;
+      d->length -= d->nsect;
       d->intrq = 1;
       if (d->length == 0) {
+        if (ide_write_block(d) < 0) {
+          ide_set_error(d);
+          return;	
+        }
         d->state = IDE_IDLE;
         d->taskfile.status |= ST_DSC;
         completed(&d->taskfile);
+        return;
       }
+      /* Next block follows on in the gather buffer or the mapping */
+      next_block(d);
+      d->dend = d->dptr + 512 * d->nsect;
+      if (d->map && ide_map_block(d) < 0)
+        ide_set_error(d);
     }
   }
 }
@@ -547,8 +1131,23 @@ static void ide_issue_command(struct ide_taskfile *t)
       break;
     case IDE_CMD_READ:		/* 0x20 */
     case IDE_CMD_READ_NR:	/* 0x21 */
+      t->drive->block = 1;
       cmd_readsectors_complete(t);
       break;
+    case IDE_CMD_READ_MULTI:	/* 0xC4 */
+      if (multi_setup(t))
+        cmd_readsectors_complete(t);
+      break;
+    case IDE_CMD_WRITE_MULTI:	/* 0xC5 */
+      if (multi_setup(t))
+        cmd_writesectors_complete(t);
+      break;
+    case IDE_CMD_SET_MULTI:	/* 0xC6 */
+      cmd_setmulti_complete(t);
+      break;
+    case IDE_CMD_FLUSH_CACHE:	/* 0xE7 */
+      cmd_flushcache_complete(t);
+      break;
     case IDE_CMD_SETFEATURES:	/* 0xEF */
       cmd_setfeatures_complete(t);
       break;
@@ -558,6 +1157,7 @@ static void ide_issue_command(struct ide_taskfile *t)
       break;
     case IDE_CMD_WRITE:		/* 0x30 */
     case IDE_CMD_WRITE_NR:	/* 0x31 */
+      t->drive->block = 1;
       cmd_writesectors_complete(t);
       break;
     default:
@@ -713,6 +1313,41 @@ struct ide_controller *ide_allocate(const char *name)
   return c;
 }
 
+/* Load the index of a sparse image, the header is in d->data */
+static int sparse_attach(struct ide_drive *d)
+{
+  struct stat st;
+  uint32_t i;
+  off_t bytes;
+
+  d->sp_total = d->data[8] | (d->data[9] << 8) | (d->data[10] << 16) |
+    ((uint32_t)d->data[11] << 24);
+  d->sp_blocks = (d->sp_total - 2 + IDE_SPARSE_BLOCK - 1) / IDE_SPARSE_BLOCK;
+  if (d->sp_total < 2 || d->data[12] != IDE_SPARSE_BLOCK || d->data[13] ||
+      d->data[14] || d->data[15]) {
+    ide_fault(d, "bad sparse header");
+    return -1;
+  }
+  bytes = 4 * (off_t)d->sp_blocks;
+  d->sp_data = 2 + (bytes + 511) / 512;
+  d->sparse = malloc(bytes ? bytes : 1);
+  if (d->sparse == NULL || pread(d->fd, d->sparse, bytes, 1024) != bytes ||
+      fstat(d->fd, &st) == -1) {
+    ide_fault(d, "i/o error on sparse index");
+    free(d->sparse);
+    d->sparse = NULL;
+    return -1;
+  }
+  for (i = 0; i < d->sp_blocks; i++)
+    d->sparse[i] = le32(d->sparse[i]);
+  /* New blocks go on the end */
+  bytes = st.st_size - 512 * d->sp_data;
+  d->sp_next = 1;
+  if (bytes > 0)
+    d->sp_next += (bytes + 512 * IDE_SPARSE_BLOCK - 1) / (512 * IDE_SPARSE_BLOCK);
+  return 0;
+}
+
 /*
  *	Attach a file to a device on the controller
  */
@@ -729,7 +1364,10 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
     ide_fault(d, "i/o error on attach");
     return -1;
   }
-  if (memcmp(d->data, ide_magic, 8)) {
+  if (memcmp(d->data, ide_sparse_magic, 8) == 0) {
+    if (sparse_attach(d) < 0)
+      return -1;
+  } else if (memcmp(d->data, ide_magic, 8)) {
     ide_fault(d, "bad magic");
     return -1;
   }
@@ -739,30 +1377,256 @@ int ide_attach(struct ide_controller *c, int drive, int fd)
     d->lba = 1;
   else
     d->lba = 0;
+  /* The geometry and size come from the image */
+  d->cylinders = le16(d->identify[1]);
+  d->heads = le16(d->identify[3]);
+  d->sectors = le16(d->identify[6]);
+  if (d->lba)
+    d->capacity = le16(d->identify[60]) | ((uint32_t)le16(d->identify[61]) << 16);
+  else
+    d->capacity = d->cylinders * d->heads * d->sectors;
+  /* Older images were made without multiple mode, we always support it */
+  d->identify[47] = le16(0x8000 | IDE_MAX_MULTI);
+  d->identify[59] = 0;
+  d->multi = 0;
+  return 0;
+}
+
+/*
+ *	Attach a file and map it into memory. Sector transfers then go
+ *	straight to and from the mapping, and the image is only synced on
+ *	a FLUSH CACHE command or detach. If the file cannot be mapped we
+ *	fall back to ordinary I/O.
+ */
+int ide_attach_mmap(struct ide_controller *c, int drive, int fd)
+{
+  struct ide_drive *d = &c->drive[drive];
+  struct stat st;
+  void *p;
+
+  if (ide_attach(c, drive, fd) < 0)
+    return -1;
+  if (d->sparse) {
+    ide_fault(d, "sparse images cannot be mapped, using read/write");
+    return 0;
+  }
+  if (fstat(fd, &st) == -1 || st.st_size < 1024) {
+    ide_fault(d, "cannot size image for mapping");
+    return 0;
+  }
+  p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) {
+    ide_fault(d, "mmap failed, using read/write");
+    return 0;
+  }
+  d->map = p;
+  d->mapsize = st.st_size;
+  return 0;
+}
+
+/*
+ *	Attach a read only base image with a copy on write overlay. An empty
+ *	overlay file is initialised, otherwise it must match the base size.
+ */
+int ide_attach_cow(struct ide_controller *c, int drive, int fd, int cowfd)
+{
+  struct ide_drive *d = &c->drive[drive];
+  uint8_t hdr[512];
+  uint32_t sectors;
+  off_t bsize;
+  ssize_t len;
+
+  if (ide_attach(c, drive, fd) < 0)
+    return -1;
+  if (image_sectors(d) < 0)
+    goto bad;
+  sectors = image_sectors(d);
+  bsize = (sectors + 4095) / 4096;	/* Bitmap sectors */
+  d->cow = calloc(bsize, 512);
+  if (d->cow == NULL)
+    goto bad;
+  d->cowfd = cowfd;
+  d->cowsectors = sectors;
+  d->cowdata = 1 + bsize;
+
+  len = pread(cowfd, hdr, 512, 0);
+  if (len == 0) {
+    memset(hdr, 0, 512);
+    memcpy(hdr, cow_magic, 8);
+    hdr[8] = sectors;
+    hdr[9] = sectors >> 8;
+    hdr[10] = sectors >> 16;
+    hdr[11] = sectors >> 24;
+    if (pwrite(cowfd, hdr, 512, 0) != 512)
+      goto bad;
+    d->cowdirty = 1;
+    if (cow_sync(d) < 0)
+      goto bad;
+    return 0;
+  }
+  if (len != 512 || memcmp(hdr, cow_magic, 8) ||
+      (hdr[8] | (hdr[9] << 8) | (hdr[10] << 16) | ((uint32_t)hdr[11] << 24)) != sectors) {
+    ide_fault(d, "overlay does not match image");
+    goto fail;
+  }
+  if (pread(cowfd, d->cow, bsize * 512, 512) != bsize * 512)
+    goto bad;
+  return 0;
+bad:
+  ide_fault(d, "i/o error on overlay");
+fail:
+  free(d->cow);
+  d->cow = NULL;
+  d->present = 0;
+  return -1;
+}
+
+/*
+ *	Copy everything written to the overlay into the base image, which
+ *	must have been opened for writing, and empty the overlay.
+ */
+int ide_cow_commit(struct ide_drive *d)
+{
+  off_t sector = 0;
+  int run;
+
+  if (d->cow == NULL)
+    return 0;
+  if (cache && cache_flush(d, 0) < 0)
+    return -1;
+  while (sector < d->cowsectors) {
+    if (!cow_test(d, sector)) {
+      sector++;
+      continue;
+    }
+    for (run = 1; run < IDE_XFER_MAX && cow_test(d, sector + run); run++);
+    if (pread(d->cowfd, d->xfer, 512 * run, 512 * (d->cowdata + sector)) != 512 * run ||
+        image_write(d, d->xfer, run, sector) != 512 * run) {
+      ide_fault(d, "overlay commit failed");
+      return -1;
+    }
+    sector += run;
+  }
+  if (fsync(d->fd) == -1)
+    return -1;
+  memset(d->cow, 0, (d->cowdata - 1) * 512);
+  d->cowdirty = 1;
+  if (cow_sync(d) < 0 || ftruncate(d->cowfd, 512 * d->cowdata) == -1)
+    return -1;
   return 0;
 }
 
 /*
- *	Detach an IDE device from the interface (not hot pluggable)
+ *	Set how many sectors to read ahead. A read always fetches the rest
+ *	of the command in one go, this lets a run of short sequential reads
+ *	be served from a single host read as well.
  */
-void ide_detach(struct ide_drive *d)
+void ide_set_readahead(struct ide_controller *c, int drive, int sectors)
 {
+  struct ide_drive *d = &c->drive[drive];
+  if (sectors > IDE_XFER_MAX)
+    sectors = IDE_XFER_MAX;
+  d->readahead = sectors;
+  d->xcount = 0;
+}
+
+/*
+ *	Set up the sector cache shared by all drives. Must be called before
+ *	any drive is attached. Mapped drives do not use it.
+ */
+int ide_cache_init(int sectors, int writeback)
+{
+  unsigned int size = 1;
+  int i;
+
+  if (sectors <= 0)
+    return 0;
+  while (size < (unsigned int)sectors)
+    size <<= 1;
+  cache = calloc(sectors, sizeof(*cache));
+  cache_hash = calloc(size, sizeof(*cache_hash));
+  if (cache == NULL || cache_hash == NULL) {
+    free(cache);
+    free(cache_hash);
+    cache = NULL;
+    return -1;
+  }
+  cache_mask = size - 1;
+  cache_writeback = writeback;
+  for (i = 0; i < sectors; i++) {
+    cache[i].next = cache_free;
+    cache_free = &cache[i];
+  }
+  return 0;
+}
+
+void ide_cache_stats(unsigned long *hits, unsigned long *misses)
+{
+  *hits = cache_hits;
+  *misses = cache_misses;
+}
+
+/*
+ *	Detach an IDE device from the interface (not hot pluggable). If
+ *	cached writes cannot be saved the drive is left attached, so they
+ *	are not lost, and -1 returned.
+ */
+int ide_detach(struct ide_drive *d)
+{
+  if (cache && cache_flush(d, 1) < 0) {
+    ide_fault(d, "unsaved writes, not detached");
+    return -1;
+  }
+  if (d->map) {
+    msync(d->map, d->mapsize, MS_SYNC);
+    munmap(d->map, d->mapsize);
+    d->map = NULL;
+  }
+  if (d->cow) {
+    cow_sync(d);
+    free(d->cow);
+    d->cow = NULL;
+    close(d->cowfd);
+  }
+  free(d->sparse);
+  d->sparse = NULL;
   close(d->fd);
   d->fd = -1;
   d->present = 0;
+  return 0;
+}
+
+/*
+ *	Write back anything held for the drives of a controller, as FLUSH
+ *	CACHE would. For use when the guest is stopped without a chance to
+ *	issue one.
+ */
+int ide_flush(struct ide_controller *c)
+{
+  int r = 0;
+  if (c->drive[0].present && drive_flush(&c->drive[0]) == -1)
+    r = -1;
+  if (c->drive[1].present && drive_flush(&c->drive[1]) == -1)
+    r = -1;
+  return r;
 }
 
 /*
- *	Free up and release and IDE controller
+ *	Free up and release and IDE controller. Fails, keeping the controller,
+ *	if a drive could not be detached.
  */  
-void ide_free(struct ide_controller *c)
+int ide_free(struct ide_controller *c)
 {
-  if (c->drive[0].present)
-    ide_detach(&c->drive[0]);
-  if (c->drive[1].present)
-    ide_detach(&c->drive[1]);
+  int r = 0;
+  if (c->drive[0].present && ide_detach(&c->drive[0]) < 0)
+    r = -1;
+  if (c->drive[1].present && ide_detach(&c->drive[1]) < 0)
+    r = -1;
+  if (r)
+    return -1;
   free((void *)c->name);
   free(c);
+  return 0;
 }
 
 /*
@@ -817,29 +1681,70 @@ static void make_serial(uint16_t *p)
   make_ascii(p, buf, 20);
 }
 
-int ide_make_drive(uint8_t type, int fd)
+void (*ide_make_progress)(uint32_t done, uint32_t total);
+
+#define FILL_SECTORS	2048	/* 1MB per write */
+
+/* Fill the data area with 0xE5. That isn't zero so a hole won't do, but
+   we can reserve the space up front and write it in big chunks */
+static int fill_drive(int fd, uint32_t sectors)
+{
+  uint8_t *buf;
+  uint32_t done = 0;
+  ssize_t len;
+  int n;
+
+#ifdef __linux__
+  /* Best effort, not all file systems can do it */
+  posix_fallocate(fd, 1024, 512 * (off_t)sectors);
+#endif
+  buf = malloc(512 * FILL_SECTORS);
+  if (buf == NULL)
+    return -1;
+  memset(buf, 0xE5, 512 * FILL_SECTORS);
+  while (done < sectors) {
+    n = sectors - done < FILL_SECTORS ? sectors - done : FILL_SECTORS;
+    len = write(fd, buf, 512 * n);
+    if (len <= 0 || len % 512) {
+      free(buf);
+      return -1;
+    }
+    done += len / 512;
+    if (ide_make_progress)
+      ide_make_progress(done, sectors);
+  }
+  free(buf);
+  return 0;
+}
+
+static int make_drive(uint8_t type, int fd, int sparse, uint32_t lba,
+                      uint16_t c, uint8_t h, uint8_t s)
 {
-  uint8_t s, h;
-  uint16_t c;
   uint32_t sectors;
   uint16_t ident[256];
+  uint8_t *hdr = (uint8_t *)ident;
+  uint32_t blocks;
+
 
-  if (type < 1 || type > MAX_DRIVE_TYPE)
-    return -2;
-  
   memset(ident, 0, 512);
-  memcpy(ident, ide_magic, 8);
+  memcpy(ident, sparse ? ide_sparse_magic : ide_magic, 8);
   if (write(fd, ident, 512) != 512)
     return -1;
 
   memset(ident, 0, 8);
   ident[0] = le16((1 << 15) | (1 << 6));	/* Non removable */
   make_serial(ident + 10);
-  ident[47] = 0; /* no read multi for now */
+  ident[47] = le16(0x8000 | IDE_MAX_MULTI);	/* READ/WRITE MULTIPLE */
   ident[51] = le16(240 /* PIO2 */ << 8);	/* PIO cycle time */
   ident[53] = le16(1);		/* Geometry words are valid */
   
   switch(type) {
+    case ACME_CUSTOM:
+      /* Geometry supplied by the caller, always LBA capable */
+      make_ascii(ident + 23, "A001.001", 8);
+      make_ascii(ident + 27, "ACME WILE E v0.1", 40);
+      ident[49] = le16(1 << 9); /* LBA */
+      break;
     case ACME_ROADRUNNER:
       /* 504MB drive with LBA support */
       c = 1024;
@@ -885,14 +1790,77 @@ int ide_make_drive(uint8_t type, int fd)
   sectors = c * h * s;
   ident[57] = le16(sectors & 0xFFFF);
   ident[58] = le16(sectors >> 16);
-  ident[60] = ident[57];
-  ident[61] = ident[58];
+  /* Words 60/61 are the LBA capacity, which can be more than CHS can
+     reach. Drives without LBA leave them zero */
+  if (ident[49]) {
+    if (lba > sectors)
+      sectors = lba;
+    ident[60] = le16(sectors & 0xFFFF);
+    ident[61] = le16(sectors >> 16);
+  }
   if (write(fd, ident, 512) != 512)
     return -1;
-  
-  memset(ident, 0xE5, 512);
-  while(sectors--)
-    if (write(fd, ident, 512) != 512)
-      return -1;  
-  return 0;
+
+  if (sparse) {
+    /* Header and an empty index, which is left as a hole */
+    memset(hdr, 0, 512);
+    memcpy(hdr, ide_sparse_magic, 8);
+    sectors += 2;
+    hdr[8] = sectors;
+    hdr[9] = sectors >> 8;
+    hdr[10] = sectors >> 16;
+    hdr[11] = sectors >> 24;
+    hdr[12] = IDE_SPARSE_BLOCK;
+    blocks = (sectors - 2 + IDE_SPARSE_BLOCK - 1) / IDE_SPARSE_BLOCK;
+    if (pwrite(fd, hdr, 512, 0) != 512 ||
+        ftruncate(fd, 512 * (2 + (4 * (off_t)blocks + 511) / 512)) == -1)
+      return -1;
+    return 0;
+  }
+
+  return fill_drive(fd, sectors);
+}
+
+int ide_make_drive(uint8_t type, int fd)
+{
+  if (type < 1 || type > MAX_DRIVE_TYPE)
+    return -2;
+  return make_drive(type, fd, 0, 0, 0, 0, 0);
+}
+
+/*
+ *	Make a sparse drive image. Only the header, identify block and the
+ *	index are written so it is created at once and grows as used.
+ */
+int ide_make_sparse(uint8_t type, int fd)
+{
+  if (type < 1 || type > MAX_DRIVE_TYPE)
+    return -2;
+  return make_drive(type, fd, 1, 0, 0, 0, 0);
+}
+
+/*
+ *	Make an LBA drive of any size up to the 28bit LBA limit. Either the
+ *	capacity or the geometry may be zero in which case it is worked out
+ *	from the other. Large drives report the usual 16383/16/63 geometry
+ *	and are only fully reachable by LBA.
+ */
+int ide_make_custom(int fd, uint32_t lba, uint16_t c, uint8_t h, uint8_t s,
+                    int sparse)
+{
+  if (c == 0 && h == 0 && s == 0) {
+    uint32_t cyls = lba / (16 * 63);
+    if (cyls > 16383)
+      cyls = 16383;
+    c = cyls;
+    h = 16;
+    s = 63;
+  }
+  if (c == 0 || h == 0 || h > 16 || s == 0)
+    return -2;
+  if (lba == 0)
+    lba = c * h * s;
+  if (lba > IDE_LBA28_MAX || (uint32_t)c * h * s > lba)
+    return -2;
+  return make_drive(ACME_CUSTOM, fd, sparse, lba, c, h, s);
 }
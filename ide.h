@@ -1,5 +1,6 @@
 #include <stdint.h>
 
+#define ACME_CUSTOM		0	/* Made to order, see ide_make_custom */
 #define ACME_ROADRUNNER		1	/* 504MB classic IDE drive */
 #define ACME_COYOTE		2	/* 20MB early IDE drive */
 #define ACME_NEMESIS		3	/* 20MB LBA capable drive */
@@ -7,6 +8,12 @@
 
 #define MAX_DRIVE_TYPE		4
 
+#define IDE_LBA28_MAX		0x0FFFFFFF	/* Sectors, just under 128GB */
+
+#define IDE_MAX_MULTI		16	/* Sectors per READ/WRITE MULTIPLE block */
+#define IDE_XFER_MAX		256	/* Largest transfer (one command) */
+#define IDE_SPARSE_BLOCK	64	/* Sectors per sparse image block */
+
 #define		ide_data	0
 #define		ide_error_r	1
 #define		ide_feature_w	1
@@ -46,13 +53,34 @@ struct ide_drive {
   unsigned int present:1, intrq:1, failed:1, lba:1, eightbit:1;
   uint16_t cylinders;
   uint8_t heads, sectors;
+  uint32_t capacity;		/* Addressable sectors */
   uint8_t data[512];
   uint16_t identify[256];
   uint8_t *dptr;
+  uint8_t *dend;		/* End of the current sector */
+  uint8_t *map;			/* Image mapping or NULL for read/write */
+  off_t mapsize;
   int state;
   int fd;
   off_t offset;
   int length;
+  uint8_t multi;		/* SET MULTIPLE count, 0 if disabled */
+  uint8_t block;		/* Sectors per block for this command */
+  uint8_t nsect;		/* Sectors in the current block */
+  uint8_t xfer[512 * IDE_XFER_MAX];	/* Staged reads and gathered writes */
+  off_t xoff;			/* First sector in xfer */
+  int xcount;			/* Valid sectors staged for reading */
+  int readahead;		/* Sectors to read ahead */
+  uint8_t *cow;			/* Overlay bitmap or NULL if none */
+  int cowfd;
+  off_t cowsectors;		/* Sectors the overlay covers */
+  off_t cowdata;		/* First data sector in the overlay */
+  int cowdirty;			/* Bitmap needs writing back */
+  uint32_t *sparse;		/* Sparse image index or NULL if flat */
+  uint32_t sp_blocks;		/* Index entries */
+  uint32_t sp_total;		/* Sectors in the image */
+  uint32_t sp_next;		/* Next data block to allocate */
+  off_t sp_data;		/* First data sector */
 };
 
 struct ide_controller {
@@ -63,6 +91,7 @@ struct ide_controller {
 };
 
 extern const uint8_t ide_magic[8];
+extern const uint8_t ide_sparse_magic[8];
 
 void ide_reset_begin(struct ide_controller *c);
 uint8_t ide_read8(struct ide_controller *c, uint8_t r);
@@ -74,7 +103,19 @@ void ide_write_latched(struct ide_controller *c, uint8_t r, uint8_t v);
 
 struct ide_controller *ide_allocate(const char *name);
 int ide_attach(struct ide_controller *c, int drive, int fd);
-void ide_detach(struct ide_drive *d);
-void ide_free(struct ide_controller *c);
+int ide_attach_mmap(struct ide_controller *c, int drive, int fd);
+int ide_attach_cow(struct ide_controller *c, int drive, int fd, int cowfd);
+int ide_cow_commit(struct ide_drive *d);
+void ide_set_readahead(struct ide_controller *c, int drive, int sectors);
+int ide_cache_init(int sectors, int writeback);
+void ide_cache_stats(unsigned long *hits, unsigned long *misses);
+int ide_detach(struct ide_drive *d);
+int ide_flush(struct ide_controller *c);
+int ide_free(struct ide_controller *c);
 
+/* If set, called as the data area of a new drive is written */
+extern void (*ide_make_progress)(uint32_t done, uint32_t total);
 int ide_make_drive(uint8_t type, int fd);
+int ide_make_sparse(uint8_t type, int fd);
+int ide_make_custom(int fd, uint32_t lba, uint16_t c, uint8_t h, uint8_t s,
+                    int sparse);
@@ -34,9 +34,16 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef I8085_JIT
+#ifndef __x86_64__
+#error "I8085_JIT needs an x86-64 host"
+#endif
+#include <sys/mman.h>
+#endif
 #include "intel_8085_emulator.h"
+#include "flagtab.h"
 
-#define reg16_PSW (((uint16_t)reg8[A] << 8) | (uint16_t)reg8[FLAGS])
+#define reg16_PSW (((uint16_t)reg8[A] << 8) | (uint16_t)*flagp())
 #define reg16_BC (((uint16_t)reg8[B] << 8) | (uint16_t)reg8[C])
 #define reg16_DE (((uint16_t)reg8[D] << 8) | (uint16_t)reg8[E])
 #define reg16_HL (((uint16_t)reg8[H] << 8) | (uint16_t)reg8[L])
@@ -45,41 +52,59 @@ uint8_t reg8[9], INTE = 0;
 uint16_t reg_SP, reg_PC;
 uint8_t reg_IM = 0;
 uint8_t intprotect;
-#define set_S() reg8[FLAGS] |= 0x80
-#define set_Z() reg8[FLAGS] |= 0x40
-#define set_K() reg8[FLAGS] |= 0x20
-#define set_AC() reg8[FLAGS] |= 0x10
-#define set_P() reg8[FLAGS] |= 0x04
-#define set_V() reg8[FLAGS] |= 0x02
-#define set_C() reg8[FLAGS] |= 0x01
-#define clear_S() reg8[FLAGS] &= 0x7F
-#define clear_Z() reg8[FLAGS] &= 0xBF
-#define clear_K() reg8[FLAGS] &= 0xDF
-#define clear_AC() reg8[FLAGS] &= 0xEF
-#define clear_P() reg8[FLAGS] &= 0xFB
-#define clear_V() reg8[FLAGS] &= 0xFD
-#define clear_C() reg8[FLAGS] &= 0xFE
-#define test_S() (reg8[FLAGS] & 0x80)
-#define test_Z() (reg8[FLAGS] & 0x40)
-#define test_K() (reg8[FLAGS] & 0x20)
-#define test_AC() (reg8[FLAGS] & 0x10)
-#define test_P() (reg8[FLAGS] & 0x04)
-#define test_V() (reg8[FLAGS] & 0x02)
-#define test_C() (reg8[FLAGS] & 0x01)
+FILE *i8085_log;
+/*
+ *	Lazy flags. The ALU operations that set most of the flags just
+ *	record the operation and the operands. The flags are only worked
+ *	out when something looks at them, or changes only some of them. Most
+ *	of the time the next ALU operation overwrites them first.
+ */
+#define LF_NONE		0	/* reg8[FLAGS] is up to date */
+#define LF_ADD		1	/* ADD/ADC: lf_a + lf_b + lf_c */
+#define LF_SUB		2	/* SUB/SBB/CMP: lf_a - lf_b - lf_c */
+#define LF_ANA		3	/* ANA: lf_a & lf_b */
+#define LF_LOGIC	4	/* ORA/XRA: result in lf_a */
+#define LF_INR		5	/* INR of lf_a */
+#define LF_DCR		6	/* DCR of lf_a */
+
+static uint8_t lf_op, lf_a, lf_b, lf_c;
+
+static void flags_sync(void);
+
+/* Get the flags register, resolving any pending flag calculation */
+static inline uint8_t *flagp(void)
+{
+	if (lf_op)
+		flags_sync();
+	return &reg8[FLAGS];
+}
+
+#define set_S() *flagp() |= 0x80
+#define set_Z() *flagp() |= 0x40
+#define set_K() *flagp() |= 0x20
+#define set_AC() *flagp() |= 0x10
+#define set_P() *flagp() |= 0x04
+#define set_V() *flagp() |= 0x02
+#define set_C() *flagp() |= 0x01
+#define clear_S() *flagp() &= 0x7F
+#define clear_Z() *flagp() &= 0xBF
+#define clear_K() *flagp() &= 0xDF
+#define clear_AC() *flagp() &= 0xEF
+#define clear_P() *flagp() &= 0xFB
+#define clear_V() *flagp() &= 0xFD
+#define clear_C() *flagp() &= 0xFE
+#define test_S() (*flagp() & 0x80)
+#define test_Z() (*flagp() & 0x40)
+#define test_K() (*flagp() & 0x20)
+#define test_AC() (*flagp() & 0x10)
+#define test_P() (*flagp() & 0x04)
+#define test_V() (*flagp() & 0x02)
+#define test_C() (*flagp() & 0x01)
 
 static uint8_t intpend;
 static uint8_t halted;
-
-static const uint8_t parity[0x100] = {
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0,
-	0, 1, 1, 0, 1, 0, 0, 1, 1, 0, 0, 1, 0, 1, 1, 0, 1, 0, 0, 1, 0, 1, 1, 0, 0, 1, 1, 0, 1, 0, 0, 1
-};
+static uint8_t yield;
+static int exec_start, exec_left;	/* For i8085_elapsed */
 
 uint16_t read_RP(uint8_t rp) {
 	switch (rp) {
@@ -164,273 +189,2629 @@ void write16_RP_PUSHPOP(uint8_t rp, uint16_t value) {
 			reg8[H] = value >> 8;
 			break;
 		case 0x03:
+			lf_op = LF_NONE;
 			reg8[FLAGS] = (value & 0x00FF) & 0xF7;
 			reg8[A] = value >> 8;
 			break;
 	}
 }
 
+/*
+ *	The calc_ helpers update reg8[FLAGS] directly and must only be used
+ *	once any pending lazy flags have been resolved.
+ */
+#define flag_if(f, c) \
+	reg8[FLAGS] = (c) ? (reg8[FLAGS] | (f)) : (reg8[FLAGS] & ~(f))
+
 void calc_SZP(uint8_t value) {
-	if (value == 0) set_Z(); else clear_Z();
-	if (value & 0x80) set_S(); else clear_S();
-	if (parity[value]) set_P(); else clear_P();
+	reg8[FLAGS] = (reg8[FLAGS] & 0x3B) | szp_flags[value];
 }
 
 void calc_AC(uint8_t val1, uint8_t val2) {
-	if (((val1 & 0x0F) + (val2 & 0x0F)) > 0x0F) {
-		set_AC();
+	flag_if(0x10, ((val1 & 0x0F) + (val2 & 0x0F)) > 0x0F);
+}
+
+void calc_AC_carry(uint8_t val1, uint8_t val2) {
+	flag_if(0x10, ((val1 & 0x0F) + (val2 & 0x0F)) >= 0x0F);
+}
+
+void calc_subAC(int8_t val1, uint8_t val2) {
+	flag_if(0x10, (val2 & 0x0F) <= (val1 & 0x0F));
+}
+
+void calc_subAC_borrow(int8_t val1, uint8_t val2) {
+	flag_if(0x10, (val2 & 0x0F) < (val1 & 0x0F));
+}
+
+void calc_Vadd(int8_t val1, int8_t val2, int c)
+{
+	/* Did adding bits 0-6 together carry into bit 7 ? */
+	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + c) & 0x80;
+	/* Did adding bits 0-7 together carry into bit 8 ? */
+	uint16_t c7 = ((uint16_t)val1 + val2 + c) & 0x100;
+	/* V is the xor of the two carries */
+	/* Annoying C has no ^^ operator */
+	flag_if(0x02, (!!c6) ^ (!!c7));
+}
+
+/* 16bit maths is actually 8bit maths done twice */
+void calc_Vadd16(int16_t val1, int16_t val2)
+{
+	/* Internal carry of the first add */
+	int c = ((val1 & 0xFF) + (val2 & 0xFF)) & 0x100;
+	/* Fed into the carry of the following adc */
+	calc_Vadd(val1 >> 8, val2 >> 8, !!c);
+}
+
+void calc_Vsub(int8_t val1, int8_t val2, int c)
+{
+	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - c) & 0x80;
+	uint16_t c7 = ((val1 - val2 - c) & 0x100) >> 1;
+	flag_if(0x02, c6 ^ c7);
+}
+
+void calc_Vsub16(int16_t val1, int16_t val2)
+{
+	int c = (val1 & 0xFF) < (val2 & 0xFF);
+	calc_Vsub(val1 >> 8, val2 >> 8, c);
+}
+
+void calc_K(int8_t r)
+{
+	flag_if(0x20, (!!(reg8[FLAGS] & 0x02)) ^ !!(r & 0x80));
+}
+
+void calc_KVlogic(uint8_t val)
+{
+	reg8[FLAGS] &= 0xFD;
+	calc_K(val);
+}
+
+/* Work out the flags for an ALU operation. Bit 3 is always preserved,
+   and INR/DCR also preserve the carry */
+static void flags_eval(uint8_t op, uint8_t a, uint8_t b, uint8_t c)
+{
+	uint8_t f = reg8[FLAGS] & 0x08;
+
+	switch(op) {
+	case LF_ADD:
+		reg8[FLAGS] = f | add_flags[c][(a << 8) | b];
+		break;
+	case LF_SUB:
+		reg8[FLAGS] = f | sub_flags[c][(a << 8) | b];
+		break;
+	case LF_ANA:
+		reg8[FLAGS] = f | logic_flags[a & b] | (((a | b) & 0x08) << 1);
+		break;
+	case LF_LOGIC:
+		reg8[FLAGS] = f | logic_flags[a];
+		break;
+	case LF_INR:
+		reg8[FLAGS] = (reg8[FLAGS] & 0x09) | inr_flags[a];
+		break;
+	case LF_DCR:
+		reg8[FLAGS] = (reg8[FLAGS] & 0x09) | dcr_flags[a];
+		break;
+	}
+}
+
+static void flags_sync(void)
+{
+	uint8_t op = lf_op;
+	lf_op = LF_NONE;
+	flags_eval(op, lf_a, lf_b, lf_c);
+}
+
+/* Record the flag setting operation. Building with I8085_EAGER_FLAGS
+   works the flags out straight away instead for comparison */
+static inline void flags_set(uint8_t op, uint8_t a, uint8_t b, uint8_t c)
+{
+#ifdef I8085_EAGER_FLAGS
+	flags_eval(op, a, b, c);
+#else
+	lf_op = op;
+	lf_a = a;
+	lf_b = b;
+	lf_c = c;
+#endif
+}
+
+/*
+ *	ALU operations. These are shared by both CPU cores and keep the
+ *	flag behaviour in one place.
+ */
+static inline void alu_add(uint8_t val)
+{
+	flags_set(LF_ADD, reg8[A], val, 0);
+	reg8[A] += val;
+}
+
+static inline void alu_adc(uint8_t val)
+{
+	uint8_t c = test_C();
+	flags_set(LF_ADD, reg8[A], val, c);
+	reg8[A] += val + c;
+}
+
+static inline void alu_cmp(uint8_t val)
+{
+	flags_set(LF_SUB, reg8[A], val, 0);
+}
+
+static inline void alu_sub(uint8_t val)
+{
+	flags_set(LF_SUB, reg8[A], val, 0);
+	reg8[A] -= val;
+}
+
+static inline void alu_sbb(uint8_t val)
+{
+	uint8_t c = test_C();
+	flags_set(LF_SUB, reg8[A], val, c);
+	reg8[A] -= val + c;
+}
+
+static inline void alu_ana(uint8_t val)
+{
+	flags_set(LF_ANA, reg8[A], val, 0);
+	reg8[A] &= val;
+}
+
+static inline void alu_xra(uint8_t val)
+{
+	reg8[A] ^= val;
+	flags_set(LF_LOGIC, reg8[A], 0, 0);
+}
+
+static inline void alu_ora(uint8_t val)
+{
+	reg8[A] |= val;
+	flags_set(LF_LOGIC, reg8[A], 0, 0);
+}
+
+/* INR and DCR leave the carry alone so must resolve it first */
+static inline uint8_t alu_inr(uint8_t val)
+{
+	if (lf_op)
+		flags_sync();
+	flags_set(LF_INR, val, 0, 0);
+	return val + 1;
+}
+
+static inline uint8_t alu_dcr(uint8_t val)
+{
+	if (lf_op)
+		flags_sync();
+	flags_set(LF_DCR, val, 0, 0);
+	return val - 1;
+}
+
+static inline uint16_t alu_inx(uint16_t val)
+{
+	val++;
+	if (val == 0x8000)
+		set_V();
+	else
+		clear_V();
+	if (val == 0x0000)
+		set_K();
+	else
+		clear_K();
+	return val;
+}
+
+static inline uint16_t alu_dcx(uint16_t val)
+{
+	val--;
+	if (val == 0x7FFF)
+		set_V();
+	else
+		clear_V();
+	if (val == 0xFFFF)
+		set_K();
+	else
+		clear_K();
+	return val;
+}
+
+static inline void alu_dad(uint16_t val)
+{
+	uint32_t temp32;
+	if (lf_op)
+		flags_sync();
+	calc_Vadd16(reg16_HL, val);
+	temp32 = (uint32_t)reg16_HL + (uint32_t)val;
+	reg8[H] = temp32 >> 8;
+	reg8[L] = temp32;
+	if (temp32 & 0xFFFF0000) set_C(); else clear_C();
+	calc_K(temp32 >> 8);
+}
+
+uint8_t test_cond(uint8_t code) {
+	switch (code) {
+		case 0: //Z not set
+			if (!test_Z()) return 1; else return 0;
+		case 1: //Z set
+			if (test_Z()) return 1; else return 0;
+		case 2: //C not set
+			if (!test_C()) return 1; else return 0;
+		case 3: //C set
+			if (test_C()) return 1; else return 0;
+		case 4: //P not set
+			if (!test_P()) return 1; else return 0;
+		case 5: //P set
+			if (test_P()) return 1; else return 0;
+		case 6: //S not set
+			if (!test_S()) return 1; else return 0;
+		case 7: //S set
+			if (test_S()) return 1; else return 0;
+	}
+	return 0;
+}
+
+#ifndef I8085_SWITCH
+
+/*
+ *	Code cache state. Memory below the common boundary belongs to the
+ *	current bank and the rest is shared. Each page notes whether it holds
+ *	cached code and has a generation count that is bumped when that code
+ *	is written to, which makes any blocks decoded from it stale.
+ */
+#define CODE_BANKS	17	/* 16 banks and the common area */
+#define CODE_COMMON	(CODE_BANKS - 1)
+
+static uint8_t code_bank;
+static uint8_t code_common;	/* First common page, 0 if no banking */
+static uint8_t code_cache = 1;
+static uint8_t code_page[CODE_BANKS][256];
+static uint8_t code_live[256];	/* code_page[] for the pages as mapped */
+static uint32_t code_gen[CODE_BANKS][256];
+static uint8_t block_stale;
+
+/* The host's page tables if it has given them */
+static uint8_t **mem_rpage, **mem_wpage;
+
+#define page_bank(p)	((p) >= code_common ? CODE_COMMON : code_bank)
+
+static void code_page_invalidate(uint8_t page)
+{
+	uint8_t bank = page_bank(page);
+	code_page[bank][page] = 0;
+	code_live[page] = 0;
+	code_gen[bank][page]++;
+	block_stale = 1;
+}
+
+/* All CPU writes go via here so that we notice code being modified */
+static inline void mem_write(uint16_t addr, uint8_t val)
+{
+	i8085_write(addr, val);
+	if (code_live[addr >> 8])
+		code_page_invalidate(addr >> 8);
+}
+
+void i8085_set_bank(uint8_t bank, uint16_t common)
+{
+	unsigned int i;
+
+	code_bank = bank % CODE_COMMON;
+	code_common = common >> 8;
+	for (i = 0; i < 256; i++)
+		code_live[i] = code_page[page_bank(i)][i];
+}
+
+void i8085_set_pages(uint8_t **rpage, uint8_t **wpage)
+{
+	mem_rpage = rpage;
+	mem_wpage = wpage;
+}
+
+void i8085_code_invalidate(uint16_t addr)
+{
+	if (code_live[addr >> 8])
+		code_page_invalidate(addr >> 8);
+}
+
+void i8085_code_cache(int enable)
+{
+	code_cache = enable;
+}
+
+#else
+
+#define mem_write(addr, val)	i8085_write(addr, val)
+
+void i8085_set_bank(uint8_t bank, uint16_t common)
+{
+}
+
+void i8085_set_pages(uint8_t **rpage, uint8_t **wpage)
+{
+}
+
+void i8085_code_invalidate(uint16_t addr)
+{
+}
+
+void i8085_code_cache(int enable)
+{
+}
+
+#endif
+
+void i8085_push(uint16_t value) {
+	mem_write(--reg_SP, value >> 8);
+	mem_write(--reg_SP, (uint8_t)value);
+}
+
+uint16_t i8085_pop() {
+	uint16_t temp;
+	temp = i8085_read(reg_SP++);
+	temp |= (uint16_t)i8085_read(reg_SP++) << 8;
+	return temp;
+}
+
+void i8085_set_int(int n)
+{
+	intpend |= n;
+}
+
+void i8085_clear_int(int n)
+{
+	intpend &= ~n;
+}
+
+
+void i8085_jump(uint16_t addr) {
+	reg_PC = addr;
+}
+
+/* Called from a host callback to end the current i8085_exec() early. The
+   instruction in progress completes and the unused cycles are returned */
+void i8085_yield(void)
+{
+	yield = 1;
+}
+
+/* The cycles the current i8085_exec() has used up to the start of the
+   instruction in progress, so host callbacks can tell the time. Zero
+   outside of i8085_exec() */
+int i8085_elapsed(void)
+{
+	return exec_start - exec_left;
+}
+
+void i8085_reset() {
+	reg_PC = reg_SP = 0x0000;
+	//reg8[FLAGS] = 0x02;
+}
+
+void i8085_write_reg8(reg_t reg, uint8_t value) {
+	if (reg == M) {
+		mem_write(reg16_HL, value);
+	} else {
+		if (reg == FLAGS)
+			lf_op = LF_NONE;
+		reg8[reg] = value;
+	}
+}
+
+uint8_t i8085_read_reg8(reg_t reg) {
+	if (reg == M) {
+		return i8085_read(reg16_HL);
 	} else {
-		clear_AC();
+		if (reg == FLAGS)
+			flags_sync();
+		return reg8[reg];
+	}
+}
+
+uint16_t i8085_read_reg16(reg_t reg) {
+	switch (reg) {
+		case AF: return reg16_PSW;
+		case BC: return reg16_BC;
+		case DE: return reg16_DE;
+		case HL: return reg16_HL;
+		case SP: return reg_SP;
+		case PC: return reg_PC;
+		default:
+			fprintf(stderr, "bogus rr16\n");
+	}
+	return 0;
+}
+
+void i8085_write_reg16(reg_t reg, uint16_t value) {
+	switch (reg) {
+		case AF: reg8[A] = value>>8; lf_op = LF_NONE; reg8[FLAGS] = value; break;
+		case BC: reg8[B] = value>>8; reg8[C] = value; break;
+		case DE: reg8[D] = value>>8; reg8[E] = value; break;
+		case HL: reg8[H] = value>>8; reg8[L] = value; break;
+		case SP: reg_SP = value; break;
+		case PC: reg_PC = value; break;
+		default:
+			fprintf(stderr, "bogus rr16\n");
+	}
+}
+
+static char *i8085_flags(uint8_t v)
+{
+	static char buf[9];
+	char *fp = "SZKA-PVC";
+	char *t = buf;
+
+	strcpy(buf, "--------");
+
+	while(*fp) {
+		if (v & 0x80)
+			*t = *fp;
+		t++;
+		fp++;
+		v <<= 1;
+	}
+	return buf;
+}
+
+/* Take any pending interrupt. Returns the cycles used */
+static int i8085_interrupt(void)
+{
+	uint8_t temp8, vec;
+
+	/* TRAP is edge and level - must see the edge and it held */
+	if (intpend & INT_NMI) {	/* TRAP - NMI */
+		INTE = 0;
+		intpend &= ~8;
+		if (halted)
+			i8085_push(reg_PC + 1);
+		else
+			i8085_push(reg_PC);
+		reg_PC = 0x24;
+		if (i8085_log)
+			fprintf(i8085_log, "NMI taken.\n");
+		return 12;	/* Check me */
+	}
+	/* The others are level except 0x3C which is positive edge.
+	   The 8085 prioritizes so we must do likewise */
+	if (INTE && intprotect == 0 && (intpend & ~reg_IM)) {
+		INTE = 0;
+		temp8 = intpend & ~reg_IM;
+
+		if (i8085_log)
+			fprintf(i8085_log, "IRQ taken (%x)\n", temp8);
+
+		if (temp8 & INT_RST75) {
+			/* FIXME: we should temporarily mask not
+			   clear here. We clear in SIM */
+			vec = 0x3C;
+			intpend &= ~INT_RST75;
+		} else if (temp8 & INT_RST65)
+			vec = 0x34;
+		else if (temp8 & INT_RST55)
+			vec = 0x2C;
+		else
+			vec = 0x38;
+		if (halted)
+			i8085_push(reg_PC + 1);
+		else
+			i8085_push(reg_PC);
+		reg_PC = vec;
+		return 12;	/* Check me */
+	}
+	return 0;
+}
+
+#ifndef I8085_SWITCH
+
+/*
+ *	Table driven core. Each opcode has a handler and the register and
+ *	condition fields are decoded once when the table is built. The
+ *	operand bytes are fetched before the handler is called and PC
+ *	already points at the next instruction. Handlers return the number
+ *	of clocks used.
+ */
+
+struct i8085_op;
+typedef int (*i8085_handler_t)(const struct i8085_op *op, uint16_t imm);
+
+struct i8085_op {
+	i8085_handler_t fn;
+	uint8_t len;		/* Operand bytes following the opcode */
+	uint8_t r1;		/* Destination register, pair or condition mask */
+	uint8_t r2;		/* Source register or condition value */
+	uint8_t end;		/* Ends a cached block */
+};
+
+static struct i8085_op optab[256];
+static uint8_t optab_ready;
+
+/* Register pairs are decoded to the index of the high register */
+#define reg16_RP(r) (((uint16_t)reg8[r] << 8) | (uint16_t)reg8[(r) + 1])
+#define set_RP(r, v) do { reg8[r] = (v) >> 8; reg8[(r) + 1] = (v); } while(0)
+
+/* Conditions are decoded to a flag mask and the value wanted */
+#define cond_true(op) ((*flagp() & (op)->r1) == (op)->r2)
+
+static const uint8_t cond_mask[8] = {
+	0x40, 0x40, 0x01, 0x01, 0x04, 0x04, 0x80, 0x80
+};
+
+static int op_bad(const struct i8085_op *op, uint16_t imm)
+{
+	printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", reg_PC - 1,
+		(unsigned int)(op - optab));
+	exit(0);
+}
+
+static int op_nop(const struct i8085_op *op, uint16_t imm)
+{
+	return 4;
+}
+
+static int op_mov(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[op->r1] = reg8[op->r2];
+	return 4;
+}
+
+static int op_mov_rm(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[op->r1] = i8085_read(reg16_HL);
+	return 7;
+}
+
+static int op_mov_mr(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_HL, reg8[op->r2]);
+	return 7;
+}
+
+static int op_mvi(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[op->r1] = imm;
+	return 7;
+}
+
+static int op_mvi_m(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_HL, imm);
+	return 10;
+}
+
+static int op_hlt(const struct i8085_op *op, uint16_t imm)
+{
+	reg_PC--;
+	halted = 1;
+	return 7;
+}
+
+static int op_lxi(const struct i8085_op *op, uint16_t imm)
+{
+	set_RP(op->r1, imm);
+	return 10;
+}
+
+static int op_lxi_sp(const struct i8085_op *op, uint16_t imm)
+{
+	reg_SP = imm;
+	return 10;
+}
+
+static int op_ldax(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[A] = i8085_read(reg16_RP(op->r1));
+	return 7;
+}
+
+static int op_stax(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_RP(op->r1), reg8[A]);
+	return 7;
+}
+
+static int op_lda(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[A] = i8085_read(imm);
+	return 13;
+}
+
+static int op_sta(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(imm, reg8[A]);
+	return 13;
+}
+
+static int op_lhld(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[L] = i8085_read(imm++);
+	reg8[H] = i8085_read(imm);
+	return 16;
+}
+
+static int op_shld(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(imm++, reg8[L]);
+	mem_write(imm, reg8[H]);
+	return 16;
+}
+
+static int op_lhlx(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[L] = i8085_read(reg16_DE);
+	reg8[H] = i8085_read(reg16_DE + 1);
+	return 10;
+}
+
+static int op_shlx(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_DE, reg8[L]);
+	mem_write(reg16_DE + 1, reg8[H]);
+	return 10;
+}
+
+static int op_xchg(const struct i8085_op *op, uint16_t imm)
+{
+	uint8_t temp8 = reg8[D];
+	reg8[D] = reg8[H];
+	reg8[H] = temp8;
+	temp8 = reg8[E];
+	reg8[E] = reg8[L];
+	reg8[L] = temp8;
+	return 5;
+}
+
+static int op_inr(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[op->r1] = alu_inr(reg8[op->r1]);
+	return 4;
+}
+
+static int op_inr_m(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_HL, alu_inr(i8085_read(reg16_HL)));
+	return 10;
+}
+
+static int op_dcr(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[op->r1] = alu_dcr(reg8[op->r1]);
+	return 4;
+}
+
+static int op_dcr_m(const struct i8085_op *op, uint16_t imm)
+{
+	mem_write(reg16_HL, alu_dcr(i8085_read(reg16_HL)));
+	return 10;
+}
+
+static int op_inx(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = alu_inx(reg16_RP(op->r1));
+	set_RP(op->r1, temp16);
+	return 6;
+}
+
+static int op_inx_sp(const struct i8085_op *op, uint16_t imm)
+{
+	reg_SP = alu_inx(reg_SP);
+	return 6;
+}
+
+static int op_dcx(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = alu_dcx(reg16_RP(op->r1));
+	set_RP(op->r1, temp16);
+	return 6;
+}
+
+static int op_dcx_sp(const struct i8085_op *op, uint16_t imm)
+{
+	reg_SP = alu_dcx(reg_SP);
+	return 6;
+}
+
+static int op_dad(const struct i8085_op *op, uint16_t imm)
+{
+	alu_dad(reg16_RP(op->r1));
+	return 10;
+}
+
+static int op_dad_sp(const struct i8085_op *op, uint16_t imm)
+{
+	alu_dad(reg_SP);
+	return 10;
+}
+
+/* Register, memory and immediate forms of each ALU operation */
+#define ALU_HANDLERS(name) \
+static int op_##name(const struct i8085_op *op, uint16_t imm) \
+{ \
+	alu_##name(reg8[op->r2]); \
+	return 4; \
+} \
+static int op_##name##_m(const struct i8085_op *op, uint16_t imm) \
+{ \
+	alu_##name(i8085_read(reg16_HL)); \
+	return 7; \
+} \
+static int op_##name##_i(const struct i8085_op *op, uint16_t imm) \
+{ \
+	alu_##name(imm); \
+	return 7; \
+}
+
+ALU_HANDLERS(add)
+ALU_HANDLERS(adc)
+ALU_HANDLERS(sub)
+ALU_HANDLERS(sbb)
+ALU_HANDLERS(ana)
+ALU_HANDLERS(xra)
+ALU_HANDLERS(ora)
+ALU_HANDLERS(cmp)
+
+static const i8085_handler_t alu_r[8] = {
+	op_add, op_adc, op_sub, op_sbb, op_ana, op_xra, op_ora, op_cmp
+};
+
+static const i8085_handler_t alu_m[8] = {
+	op_add_m, op_adc_m, op_sub_m, op_sbb_m,
+	op_ana_m, op_xra_m, op_ora_m, op_cmp_m
+};
+
+static const i8085_handler_t alu_i[8] = {
+	op_add_i, op_adc_i, op_sub_i, op_sbb_i,
+	op_ana_i, op_xra_i, op_ora_i, op_cmp_i
+};
+
+static int op_daa(const struct i8085_op *op, uint16_t imm)
+{
+	uint8_t temp8 = reg8[A];
+	uint16_t temp16 = temp8;
+	if (((temp16 & 0x0F) > 0x09) || test_AC()) {
+		if (((temp16 & 0x0F) + 0x06) & 0xF0) set_AC(); else clear_AC();
+		temp16 += 0x06;
+		if (temp16 & 0xFF00) set_C(); //can also cause carry to be set during addition to the low nibble
+	}
+	if (((temp16 & 0xF0) > 0x90) || test_C()) {
+		temp16 += 0x60;
+		if (temp16 & 0xFF00) set_C(); //doesn't clear it if this clause is false
+	}
+	calc_SZP((uint8_t)temp16);
+	reg8[A] = (uint8_t)temp16;
+	/* Verify this behaviour */
+	if ((temp8 & 0xF0) == 0x70 &&
+		(temp16 & 0xF0) == 0x80)
+		set_V();
+	else
+		clear_V();
+	calc_K(reg8[A]);
+	return 4;
+}
+
+static int op_rlc(const struct i8085_op *op, uint16_t imm)
+{
+	if (reg8[A] & 0x80) set_C(); else clear_C();
+	calc_Vadd(reg8[A],reg8[A], reg8[A] & 0x80);
+	reg8[A] = (reg8[A] >> 7) | (reg8[A] << 1);
+	calc_K(reg8[A]);
+	return 4;
+}
+
+static int op_rrc(const struct i8085_op *op, uint16_t imm)
+{
+	if (reg8[A] & 0x01) set_C(); else clear_C();
+	reg8[A] = (reg8[A] << 7) | (reg8[A] >> 1);
+	clear_V();
+	/* Verify if RR ops affect K */
+	return 4;
+}
+
+static int op_ral(const struct i8085_op *op, uint16_t imm)
+{
+	uint8_t temp8 = test_C();
+	if (reg8[A] & 0x80) set_C(); else clear_C();
+	calc_Vadd(reg8[A],reg8[A], temp8);
+	reg8[A] = (reg8[A] << 1) | temp8;
+	calc_K(reg8[A]);
+	return 4;
+}
+
+static int op_rar(const struct i8085_op *op, uint16_t imm)
+{
+	uint8_t temp8 = test_C();
+	if (reg8[A] & 0x01) set_C(); else clear_C();
+	reg8[A] = (reg8[A] >> 1) | (temp8 << 7);
+	/* Verify if RR ops affect K */
+	clear_V();
+	return 4;
+}
+
+static int op_cma(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[A] = ~reg8[A];
+	/* This does not affect flags */
+	return 4;
+}
+
+static int op_cmc(const struct i8085_op *op, uint16_t imm)
+{
+	*flagp() ^= 1;
+	return 4;
+}
+
+static int op_stc(const struct i8085_op *op, uint16_t imm)
+{
+	set_C();
+	return 4;
+}
+
+static int op_dsub(const struct i8085_op *op, uint16_t imm)
+{
+	/* Does SUB L,C; SBC H,B for flags */
+	uint8_t temp8 = reg8[C];
+	uint16_t temp16 = (uint16_t)reg8[L] - (uint16_t)temp8;
+	if ((temp16 & 0x00FF) >= reg8[L] && temp8)
+		set_C();
+	else
+		clear_C();
+	reg8[L] = (uint8_t)temp16;
+	/* We don't need the other intermediate flags */
+	temp8 = reg8[B];
+	temp16 = (uint16_t)reg8[H] - (uint16_t)temp8 - (uint16_t)test_C();
+	if (test_C())
+		calc_subAC_borrow(reg8[H], temp8);
+	else
+		calc_subAC(reg8[H], temp8);
+	calc_Vsub(reg8[H], temp8, test_C());
+	if ((temp16 & 0x00FF) >= reg8[H] && (temp8 | test_C()))
+		set_C();
+	else
+		clear_C();
+	calc_SZP((uint8_t)temp16);
+	calc_K(temp16);
+	reg8[H] = (uint8_t)temp16;
+	return 10;
+}
+
+static int op_arhl(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16;
+	if (reg16_HL & 1)
+		set_C();
+	else
+		clear_C();
+	temp16 = reg16_HL >> 1;
+	if (temp16 & 0x4000)
+		temp16 |= 0x8000;
+	set_RP(H, temp16);
+	return 7;
+}
+
+static int op_rdel(const struct i8085_op *op, uint16_t imm)
+{
+	/* Affects only CY and V */
+	uint16_t temp16 = reg16_DE;
+	uint8_t temp8 = test_C();
+	set_RP(D, (uint16_t)((temp16 << 1) + temp8));
+	if (temp16 & 0x8000)
+		set_C();
+	else
+		clear_C();
+	/* This seems to be a DAD D,D with carry but
+	   I'm not enitrely sure. FIXME */
+	calc_Vadd16(temp16, temp16 + temp8);
+	return 10;
+}
+
+static int op_rim(const struct i8085_op *op, uint16_t imm)
+{
+	uint8_t temp8 = reg_IM & 0x07;
+	if (intpend & INT_RST75)
+		temp8 |= 0x10;
+	temp8 |= i8085_get_input() ? 0x80: 0x00;
+	temp8 |= (intpend & 7)  << 4;
+	reg8[A] = temp8;
+	return 4;
+}
+
+static int op_sim(const struct i8085_op *op, uint16_t imm)
+{
+	if (reg8[A] & 0x08)
+		reg_IM = reg8[A] & 0x07;
+	if (reg8[A] & 0x10)
+		intpend &= ~INT_RST75;
+	if (reg8[A] & 0x40)
+		i8085_set_output(reg8[A] & 0x80);
+	return 4;
+}
+
+static int op_ldhi(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = reg16_HL + imm;
+	set_RP(D, temp16);
+	return 10;
+}
+
+static int op_ldsi(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = reg_SP + imm;
+	set_RP(D, temp16);
+	return 10;
+}
+
+static int op_jmp(const struct i8085_op *op, uint16_t imm)
+{
+	reg_PC = imm;
+	return 10;
+}
+
+/* Also used for JNK and JK which test the K flag */
+static int op_jcc(const struct i8085_op *op, uint16_t imm)
+{
+	if (cond_true(op)) {
+		reg_PC = imm;
+		return 10;
+	}
+	return 7;
+}
+
+static int op_call(const struct i8085_op *op, uint16_t imm)
+{
+	i8085_push(reg_PC);
+	reg_PC = imm;
+	return 18;
+}
+
+static int op_ccc(const struct i8085_op *op, uint16_t imm)
+{
+	if (cond_true(op)) {
+		i8085_push(reg_PC);
+		reg_PC = imm;
+		return 18;
+	}
+	return 9;
+}
+
+static int op_ret(const struct i8085_op *op, uint16_t imm)
+{
+	reg_PC = i8085_pop();
+	return 10;
+}
+
+static int op_rcc(const struct i8085_op *op, uint16_t imm)
+{
+	if (cond_true(op)) {
+		reg_PC = i8085_pop();
+		return 12;
+	}
+	return 6;
+}
+
+static int op_rst(const struct i8085_op *op, uint16_t imm)
+{
+	i8085_push(reg_PC);
+	reg_PC = op->r1;
+	return 12;
+}
+
+static int op_rstv(const struct i8085_op *op, uint16_t imm)
+{
+	if (test_V()) {
+		i8085_push(reg_PC);
+		reg_PC = 0x40;
+		return 12;
+	}
+	return 6;
+}
+
+static int op_pchl(const struct i8085_op *op, uint16_t imm)
+{
+	reg_PC = reg16_HL;
+	/* 6 on 8085 5 on 8080 ... */
+	return 6;
+}
+
+static int op_sphl(const struct i8085_op *op, uint16_t imm)
+{
+	reg_SP = reg16_HL;
+	return 6;
+}
+
+static int op_xthl(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = i8085_pop();
+	i8085_push(reg16_HL);
+	set_RP(H, temp16);
+	return 16;
+}
+
+static int op_push(const struct i8085_op *op, uint16_t imm)
+{
+	i8085_push(reg16_RP(op->r1));
+	/* 11 on 8080 12 on 8085 */
+	return 12;
+}
+
+static int op_push_psw(const struct i8085_op *op, uint16_t imm)
+{
+	i8085_push(read_RP_PUSHPOP(3));
+	return 12;
+}
+
+static int op_pop(const struct i8085_op *op, uint16_t imm)
+{
+	uint16_t temp16 = i8085_pop();
+	set_RP(op->r1, temp16);
+	return 10;
+}
+
+static int op_pop_psw(const struct i8085_op *op, uint16_t imm)
+{
+	write16_RP_PUSHPOP(3, i8085_pop());
+	return 10;
+}
+
+static int op_in(const struct i8085_op *op, uint16_t imm)
+{
+	reg8[A] = i8085_inport(imm);
+	return 10;
+}
+
+static int op_out(const struct i8085_op *op, uint16_t imm)
+{
+	i8085_outport(imm, reg8[A]);
+	return 10;
+}
+
+static int op_ei(const struct i8085_op *op, uint16_t imm)
+{
+	INTE = 1;
+	intprotect = 1;
+	return 4;
+}
+
+static int op_di(const struct i8085_op *op, uint16_t imm)
+{
+	INTE = 0;
+	return 4;
+}
+
+static void setop(uint8_t n, i8085_handler_t fn, uint8_t len, uint8_t r1,
+	uint8_t r2)
+{
+	optab[n].fn = fn;
+	optab[n].len = len;
+	optab[n].r1 = r1;
+	optab[n].r2 = r2;
+}
+
+static void i8085_build_optab(void)
+{
+	/* Opcodes with no operand fields */
+	static const struct {
+		uint8_t opcode;
+		uint8_t len;
+		i8085_handler_t fn;
+	} fixed[] = {
+		{ 0x00, 0, op_nop },	{ 0x08, 0, op_dsub },
+		{ 0x10, 0, op_arhl },	{ 0x18, 0, op_rdel },
+		{ 0x20, 0, op_rim },	{ 0x28, 1, op_ldhi },
+		{ 0x30, 0, op_sim },	{ 0x38, 1, op_ldsi },
+		{ 0x22, 2, op_shld },	{ 0x2A, 2, op_lhld },
+		{ 0x32, 2, op_sta },	{ 0x3A, 2, op_lda },
+		{ 0x07, 0, op_rlc },	{ 0x0F, 0, op_rrc },
+		{ 0x17, 0, op_ral },	{ 0x1F, 0, op_rar },
+		{ 0x27, 0, op_daa },	{ 0x2F, 0, op_cma },
+		{ 0x37, 0, op_stc },	{ 0x3F, 0, op_cmc },
+		{ 0xC9, 0, op_ret },	{ 0xD9, 0, op_shlx },
+		{ 0xE9, 0, op_pchl },	{ 0xF9, 0, op_sphl },
+		{ 0xC3, 2, op_jmp },	{ 0xCB, 0, op_rstv },
+		{ 0xD3, 1, op_out },	{ 0xDB, 1, op_in },
+		{ 0xE3, 0, op_xthl },	{ 0xEB, 0, op_xchg },
+		{ 0xF3, 0, op_di },	{ 0xFB, 0, op_ei },
+		{ 0xCD, 2, op_call },	{ 0xED, 0, op_lhlx },
+		{ 0x76, 0, op_hlt }
+	};
+	static const i8085_handler_t block_end[] = {
+		op_jmp, op_jcc, op_call, op_ccc, op_ret, op_rcc, op_rst,
+		op_rstv, op_pchl, op_in, op_out, op_ei, op_di, op_rim,
+		op_sim, op_hlt, op_bad
+	};
+	unsigned int n, i;
+	uint8_t dst, src, rp;
+
+	for (n = 0; n < 256; n++) {
+		dst = (n >> 3) & 7;
+		src = n & 7;
+		rp = (n >> 3) & 6;	/* Index of the high register */
+		setop(n, op_bad, 0, 0, 0);
+
+		if ((n & 0xC0) == 0x40) {
+			if (dst == M)
+				setop(n, op_mov_mr, 0, dst, src);
+			else if (src == M)
+				setop(n, op_mov_rm, 0, dst, src);
+			else
+				setop(n, op_mov, 0, dst, src);
+			continue;
+		}
+		if ((n & 0xC0) == 0x80) {
+			if (src == M)
+				setop(n, alu_m[dst], 0, 0, 0);
+			else
+				setop(n, alu_r[dst], 0, A, src);
+			continue;
+		}
+		switch(n & 0xC7) {
+		case 0x04:
+			setop(n, dst == M ? op_inr_m : op_inr, 0, dst, 0);
+			continue;
+		case 0x05:
+			setop(n, dst == M ? op_dcr_m : op_dcr, 0, dst, 0);
+			continue;
+		case 0x06:
+			setop(n, dst == M ? op_mvi_m : op_mvi, 1, dst, 0);
+			continue;
+		case 0xC0:
+			setop(n, op_rcc, 0, cond_mask[dst],
+				(dst & 1) ? cond_mask[dst] : 0);
+			continue;
+		case 0xC2:
+			setop(n, op_jcc, 2, cond_mask[dst],
+				(dst & 1) ? cond_mask[dst] : 0);
+			continue;
+		case 0xC4:
+			setop(n, op_ccc, 2, cond_mask[dst],
+				(dst & 1) ? cond_mask[dst] : 0);
+			continue;
+		case 0xC6:
+			setop(n, alu_i[dst], 1, 0, 0);
+			continue;
+		case 0xC7:
+			setop(n, op_rst, 0, n & 0x38, 0);
+			continue;
+		}
+		switch(n & 0xCF) {
+		case 0x01:
+			setop(n, rp == 6 ? op_lxi_sp : op_lxi, 2, rp, 0);
+			continue;
+		case 0x02:
+			if (rp < 4)
+				setop(n, op_stax, 0, rp, 0);
+			continue;
+		case 0x03:
+			setop(n, rp == 6 ? op_inx_sp : op_inx, 0, rp, 0);
+			continue;
+		case 0x09:
+			setop(n, rp == 6 ? op_dad_sp : op_dad, 0, rp, 0);
+			continue;
+		case 0x0A:
+			if (rp < 4)
+				setop(n, op_ldax, 0, rp, 0);
+			continue;
+		case 0x0B:
+			setop(n, rp == 6 ? op_dcx_sp : op_dcx, 0, rp, 0);
+			continue;
+		case 0xC1:
+			setop(n, rp == 6 ? op_pop_psw : op_pop, 0, rp, 0);
+			continue;
+		case 0xC5:
+			setop(n, rp == 6 ? op_push_psw : op_push, 0, rp, 0);
+			continue;
+		}
+	}
+	/* JNK and JK (both test for K clear) */
+	setop(0xDD, op_jcc, 2, 0x20, 0);
+	setop(0xFD, op_jcc, 2, 0x20, 0);
+	for (n = 0; n < sizeof(fixed) / sizeof(fixed[0]); n++)
+		setop(fixed[n].opcode, fixed[n].fn, fixed[n].len, 0, 0);
+	/* Anything that can change the flow of control or interrupt state,
+	   or talks to the outside world, must be the last thing in a block */
+	for (n = 0; n < 256; n++) {
+		for (i = 0; i < sizeof(block_end) / sizeof(block_end[0]); i++)
+			if (optab[n].fn == block_end[i])
+				optab[n].end = 1;
+	}
+	optab_ready = 1;
+}
+
+#endif
+
+/* Log the instruction about to be executed */
+static void i8085_trace(void)
+{
+	fprintf(i8085_log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
+		reg_PC, i8085_debug_read(reg_PC), i8085_debug_read(reg_PC + 1), i8085_debug_read(reg_PC + 2),
+		i8085_flags(*flagp()), reg8[A], reg16_BC, reg16_DE, reg16_HL, reg_SP);
+}
+
+#ifndef I8085_SWITCH
+
+/*
+ *	Block cache. Straight line runs of instructions are decoded once into
+ *	a list of handlers and operands, keyed by bank and address. A block
+ *	ends at anything that may branch or do I/O, and never crosses a page
+ *	so that it only depends upon one page generation.
+ */
+#define BLOCK_UOPS	32
+#define BLOCK_HASH	2048
+
+struct i8085_uop {
+	const struct i8085_op *op;
+	uint16_t imm;
+	uint16_t pc;		/* Address of the following instruction */
+};
+
+struct i8085_block {
+	uint32_t gen;
+	uint16_t pc;
+	uint8_t bank;
+	uint8_t len;		/* Number of uops, 0 if unused */
+#ifdef I8085_JIT
+	uint16_t hits;
+	int need;		/* Cycles before the last op, for native */
+	int (*native)(int cycles);
+#endif
+	struct i8085_uop uop[BLOCK_UOPS];
+};
+
+static struct i8085_block blocks[BLOCK_HASH];
+
+static struct i8085_block *block_build(struct i8085_block *b, uint16_t pc,
+	uint8_t bank)
+{
+	uint16_t start = pc;
+	uint8_t page = pc >> 8;
+	struct i8085_uop *u = b->uop;
+	const struct i8085_op *op;
+	uint16_t imm;
+
+	b->len = 0;
+	while (b->len < BLOCK_UOPS) {
+		op = optab + i8085_read(pc);
+		/* Instructions straddling a page are left to the interpreter */
+		if ((pc & 0xFF) + op->len > 0xFF)
+			break;
+		imm = 0;
+		if (op->len) {
+			imm = i8085_read(pc + 1);
+			if (op->len == 2)
+				imm |= (uint16_t)i8085_read(pc + 2) << 8;
+		}
+		pc += op->len + 1;
+		u->op = op;
+		u->imm = imm;
+		u->pc = pc;
+		u++;
+		b->len++;
+		if (op->end || (pc & 0xFF) == 0)
+			break;
+	}
+	if (b->len == 0)
+		return NULL;
+	b->pc = start;
+	b->bank = bank;
+#ifdef I8085_JIT
+	b->hits = 0;
+	b->native = NULL;
+#endif
+	b->gen = code_gen[bank][page];
+	code_page[bank][page] = 1;
+	code_live[page] = 1;
+	return b;
+}
+
+static struct i8085_block *block_get(void)
+{
+	uint8_t page = reg_PC >> 8;
+	uint8_t bank = page_bank(page);
+	struct i8085_block *b = blocks + ((reg_PC ^ (bank << 7)) & (BLOCK_HASH - 1));
+
+	if (b->len && b->pc == reg_PC && b->bank == bank &&
+		b->gen == code_gen[bank][page])
+		return b;
+	return block_build(b, reg_PC, bank);
+}
+
+/* Run a block. Interrupts cannot become pending part way through as the
+   instructions that could cause that all end blocks, but the cycle count
+   is checked between instructions as the interpreter does. A block that
+   writes over itself stops after the write */
+#ifdef I8085_JIT
+
+/*
+ *	x86-64 code generation for hot blocks. Within a block the guest
+ *	registers live in host registers: A in r12d, HL, BC and DE as 16 bit
+ *	values in r13d, r14d and r15d, SP in ebp and the flags (resolved) in
+ *	r8d, with the cycles left in ebx. Only those a block uses are loaded
+ *	on entry and written back on exit.
+ *
+ *	Memory goes directly through the host page tables. A NULL page, or a
+ *	write to a page holding cached code, takes an out of line call to the
+ *	normal path. Moves, loads and stores, the ALU, INR/DCR, INX/DCX,
+ *	stack operations and the branches are generated inline. Anything
+ *	else calls its handler with the registers written back around it.
+ *
+ *	Flags are only worked out where something after could look at them:
+ *	a flag test, a handler, or leaving the block. The generated code is
+ *	only run when there are enough cycles for block_run to have run the
+ *	whole block, so it never has to stop part way for the cycle count
+ *	and the results are the same as the interpreter's.
+ */
+#define JIT_HOT		16		/* Runs before a block is compiled */
+#define JIT_SIZE	(4 * 1024 * 1024)
+#define JIT_BLOCK_MAX	(384 * BLOCK_UOPS + 512)	/* Worst case block */
+
+static uint8_t *jit_buf;
+static uint8_t *jit_ptr;
+static uint8_t jit_failed;
+
+/* Host registers */
+#define X_RAX	0
+#define X_RCX	1
+#define X_RDX	2
+#define X_RBX	3
+#define X_RBP	5
+#define X_RSI	6
+#define X_RDI	7
+#define X_R8	8
+#define X_R12	12
+#define X_R13	13
+#define X_R14	14
+#define X_R15	15
+#define X_NONE	4	/* No index register */
+
+#define J_CYC	X_RBX
+#define J_A	X_R12
+#define J_HL	X_R13
+#define J_BC	X_R14
+#define J_DE	X_R15
+#define J_SP	X_RBP
+#define J_F	X_R8
+
+/* Guest registers held in host registers, for the load and store masks */
+#define JR_A	0x01
+#define JR_BC	0x02
+#define JR_DE	0x04
+#define JR_HL	0x08
+#define JR_SP	0x10
+#define JR_F	0x20
+
+/* Two operand ALU opcodes (r/m32, r32) and their group 1 immediate forms */
+#define X_ADD	0x01
+#define X_OR	0x09
+#define X_AND	0x21
+#define X_SUB	0x29
+#define X_XOR	0x31
+#define X_CMP	0x39
+#define X_MOV	0x89
+#define X_TEST	0x85
+#define X_XCHG	0x87
+
+#define XI_ADD	0
+#define XI_OR	1
+#define XI_AND	4
+#define XI_SUB	5
+#define XI_XOR	6
+#define XI_CMP	7
+
+#define XS_ROL	0
+#define XS_SHL	4
+#define XS_SHR	5
+
+#define XC_Z	0x4
+#define XC_NZ	0x5
+
+/* An out of line memory access, and the jumps that go to it */
+struct jit_slow {
+	uint8_t *from[2];
+	uint8_t *back;
+	uint8_t write;
+};
+
+/* The state of one compilation */
+struct jit {
+	uint8_t *p;
+	unsigned int regs;		/* JR_ mask of registers used */
+	struct jit_slow slow[3 * BLOCK_UOPS];
+	unsigned int nslow;
+	uint8_t *exit[BLOCK_UOPS];	/* Early exits for self modification */
+	uint16_t exitpc[BLOCK_UOPS];
+	unsigned int nexit;
+	uint8_t *done[2 * BLOCK_UOPS];	/* Jumps to the common exit */
+	unsigned int ndone;
+	uint8_t *leave[BLOCK_UOPS];	/* Jumps to the epilogue */
+	unsigned int nleave;
+};
+
+static void emit8(struct jit *j, uint8_t v)
+{
+	*j->p++ = v;
+}
+
+static void emit16(struct jit *j, uint16_t v)
+{
+	memcpy(j->p, &v, 2);
+	j->p += 2;
+}
+
+static void emit32(struct jit *j, uint32_t v)
+{
+	memcpy(j->p, &v, 4);
+	j->p += 4;
+}
+
+static void emit64(struct jit *j, uint64_t v)
+{
+	memcpy(j->p, &v, 8);
+	j->p += 8;
+}
+
+/* REX prefix if needed. A byte register 4-7 needs one to mean spl-dil */
+static void x_rex(struct jit *j, int w, int r, int x, int b, int byte)
+{
+	uint8_t v = 0x40 | (w << 3) | ((r & 8) >> 1) | ((x & 8) >> 2) | ((b & 8) >> 3);
+	if (v != 0x40 || byte)
+		emit8(j, v);
+}
+
+static void x_modrm(struct jit *j, int mod, int reg, int rm)
+{
+	emit8(j, (mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+/* op rm32, reg32 */
+static void x_rr(struct jit *j, uint8_t op, int rm, int reg)
+{
+	x_rex(j, 0, reg, 0, rm, 0);
+	emit8(j, op);
+	x_modrm(j, 3, reg, rm);
+}
+
+/* op rm32, imm */
+static void x_ri(struct jit *j, int ext, int rm, int32_t imm)
+{
+	x_rex(j, 0, 0, 0, rm, 0);
+	if (imm >= -128 && imm <= 127) {
+		emit8(j, 0x83);
+		x_modrm(j, 3, ext, rm);
+		emit8(j, imm);
+	} else {
+		emit8(j, 0x81);
+		x_modrm(j, 3, ext, rm);
+		emit32(j, imm);
+	}
+}
+
+/* test rm8, imm8 */
+static void x_testb(struct jit *j, int rm, uint8_t imm)
+{
+	x_rex(j, 0, 0, 0, rm, rm >= 4 && rm < 8);
+	emit8(j, 0xF6);
+	x_modrm(j, 3, 0, rm);
+	emit8(j, imm);
+}
+
+static void x_shift(struct jit *j, int ext, int rm, uint8_t n)
+{
+	x_rex(j, 0, 0, 0, rm, 0);
+	emit8(j, 0xC1);
+	x_modrm(j, 3, ext, rm);
+	emit8(j, n);
+}
+
+/* rol rm16, 8: swap the bytes of a register pair */
+static void x_swap16(struct jit *j, int rm)
+{
+	emit8(j, 0x66);
+	x_shift(j, XS_ROL, rm, 8);
+}
+
+/* movzx reg32, rm8 and rm16 */
+static void x_movzx8(struct jit *j, int reg, int rm)
+{
+	x_rex(j, 0, reg, 0, rm, rm >= 4 && rm < 8);
+	emit8(j, 0x0F);
+	emit8(j, 0xB6);
+	x_modrm(j, 3, reg, rm);
+}
+
+static void x_movzx16(struct jit *j, int reg, int rm)
+{
+	x_rex(j, 0, reg, 0, rm, 0);
+	emit8(j, 0x0F);
+	emit8(j, 0xB7);
+	x_modrm(j, 3, reg, rm);
+}
+
+static void x_movi(struct jit *j, int reg, uint32_t imm)
+{
+	x_rex(j, 0, 0, 0, reg, 0);
+	emit8(j, 0xB8 + (reg & 7));
+	emit32(j, imm);
+}
+
+static void x_movabs(struct jit *j, int reg, const void *v)
+{
+	x_rex(j, 1, 0, 0, reg, 0);
+	emit8(j, 0xB8 + (reg & 7));
+	emit64(j, (uintptr_t)v);
+}
+
+/* [base + index * scale]. base must not be rbp, r12 or r13 */
+static void x_sib(struct jit *j, int reg, int base, int index, int scale)
+{
+	x_modrm(j, 0, reg, 4);
+	emit8(j, (scale << 6) | ((index & 7) << 3) | (base & 7));
+}
+
+/* movzx reg32, byte [base + index] */
+static void x_ld8(struct jit *j, int reg, int base, int index)
+{
+	x_rex(j, 0, reg, index, base, 0);
+	emit8(j, 0x0F);
+	emit8(j, 0xB6);
+	x_sib(j, reg, base, index, 0);
+}
+
+/* mov byte [base + index], reg8 */
+static void x_st8(struct jit *j, int reg, int base, int index)
+{
+	x_rex(j, 0, reg, index, base, reg >= 4 && reg < 8);
+	emit8(j, 0x88);
+	x_sib(j, reg, base, index, 0);
+}
+
+/* mov reg64, [base + index * 8] */
+static void x_ldptr(struct jit *j, int reg, int base, int index)
+{
+	x_rex(j, 1, reg, index, base, 0);
+	emit8(j, 0x8B);
+	x_sib(j, reg, base, index, 3);
+}
+
+/* cmp byte [base + index], 0 */
+static void x_cmpb0(struct jit *j, int base, int index)
+{
+	x_rex(j, 0, 0, index, base, 0);
+	emit8(j, 0x80);
+	x_sib(j, 7, base, index, 0);
+	emit8(j, 0);
+}
+
+/* Loads and stores of variables, via rax */
+static void x_ld8abs(struct jit *j, int reg, const void *v)
+{
+	x_movabs(j, X_RAX, v);
+	x_rex(j, 0, reg, 0, 0, 0);
+	emit8(j, 0x0F);
+	emit8(j, 0xB6);
+	x_modrm(j, 0, reg, X_RAX);
+}
+
+static void x_ld16abs(struct jit *j, int reg, const void *v)
+{
+	x_movabs(j, X_RAX, v);
+	x_rex(j, 0, reg, 0, 0, 0);
+	emit8(j, 0x0F);
+	emit8(j, 0xB7);
+	x_modrm(j, 0, reg, X_RAX);
+}
+
+static void x_st8abs(struct jit *j, int reg, void *v)
+{
+	x_movabs(j, X_RAX, v);
+	x_rex(j, 0, reg, 0, 0, reg >= 4 && reg < 8);
+	emit8(j, 0x88);
+	x_modrm(j, 0, reg, X_RAX);
+}
+
+static void x_st16abs(struct jit *j, int reg, void *v)
+{
+	x_movabs(j, X_RAX, v);
+	emit8(j, 0x66);
+	x_rex(j, 0, reg, 0, 0, 0);
+	emit8(j, 0x89);
+	x_modrm(j, 0, reg, X_RAX);
+}
+
+static void x_st32abs(struct jit *j, int reg, void *v)
+{
+	x_movabs(j, X_RAX, v);
+	x_rex(j, 0, reg, 0, 0, 0);
+	emit8(j, 0x89);
+	x_modrm(j, 0, reg, X_RAX);
+}
+
+static void x_st8iabs(struct jit *j, void *v, uint8_t imm)
+{
+	x_movabs(j, X_RAX, v);
+	emit8(j, 0xC6);
+	x_modrm(j, 0, 0, X_RAX);
+	emit8(j, imm);
+}
+
+static void x_st16iabs(struct jit *j, void *v, uint16_t imm)
+{
+	x_movabs(j, X_RAX, v);
+	emit8(j, 0x66);
+	emit8(j, 0xC7);
+	x_modrm(j, 0, 0, X_RAX);
+	emit16(j, imm);
+}
+
+/* Any function, cast to this to be called */
+typedef void (*jit_fn_t)(void);
+
+static void x_call(struct jit *j, jit_fn_t fn)
+{
+	x_rex(j, 1, 0, 0, X_RAX, 0);		/* mov rax,fn */
+	emit8(j, 0xB8);
+	emit64(j, (uintptr_t)fn);
+	emit8(j, 0xFF);
+	emit8(j, 0xD0);
+}
+
+static void x_push(struct jit *j, int reg)
+{
+	x_rex(j, 0, 0, 0, reg, 0);
+	emit8(j, 0x50 + (reg & 7));
+}
+
+static void x_pop(struct jit *j, int reg)
+{
+	x_rex(j, 0, 0, 0, reg, 0);
+	emit8(j, 0x58 + (reg & 7));
+}
+
+/* Jumps. These return where the offset goes for x_patch */
+static uint8_t *x_jcc(struct jit *j, int cc)
+{
+	emit8(j, 0x0F);
+	emit8(j, 0x80 + cc);
+	emit32(j, 0);
+	return j->p - 4;
+}
+
+static uint8_t *x_jmp(struct jit *j)
+{
+	emit8(j, 0xE9);
+	emit32(j, 0);
+	return j->p - 4;
+}
+
+static uint8_t *x_jcc8(struct jit *j, int cc)
+{
+	emit8(j, 0x70 + cc);
+	emit8(j, 0);
+	return j->p - 1;
+}
+
+static void x_patch(uint8_t *at, uint8_t *to)
+{
+	uint32_t rel = to - (at + 4);
+	memcpy(at, &rel, 4);
+}
+
+static void x_patch8(uint8_t *at, uint8_t *to)
+{
+	*at = to - (at + 1);
+}
+
+/* The host register holding a register pair (given by its high register
+   or 6 for SP) or one of the 8 bit registers */
+static int jit_pair(uint8_t r)
+{
+	static const uint8_t pair[4] = { J_BC, J_DE, J_HL, J_SP };
+	return pair[(r >> 1) & 3];
+}
+
+static unsigned int jit_pair_mask(uint8_t r)
+{
+	static const uint8_t mask[4] = { JR_BC, JR_DE, JR_HL, JR_SP };
+	return mask[(r >> 1) & 3];
+}
+
+static unsigned int jit_reg_mask(uint8_t r)
+{
+	return r == A ? JR_A : jit_pair_mask(r);
+}
+
+/* Get an 8 bit register into a host register */
+static void jit_get8(struct jit *j, int dst, uint8_t r)
+{
+	int pr = jit_pair(r);
+
+	if (r == A)
+		x_rr(j, X_MOV, dst, J_A);
+	else if (r & 1)
+		x_movzx8(j, dst, pr);
+	else {
+		x_rr(j, X_MOV, dst, pr);
+		x_shift(j, XS_SHR, dst, 8);
+	}
+}
+
+/* Set an 8 bit register from a host register holding 0-255. The source
+   is lost for the high half of a pair */
+static void jit_set8(struct jit *j, uint8_t r, int src)
+{
+	int pr = jit_pair(r);
+
+	if (r == A)
+		x_rr(j, X_MOV, J_A, src);
+	else if (r & 1) {
+		x_ri(j, XI_AND, pr, 0xFF00);
+		x_rr(j, X_OR, pr, src);
+	} else {
+		x_ri(j, XI_AND, pr, 0xFF);
+		x_shift(j, XS_SHL, src, 8);
+		x_rr(j, X_OR, pr, src);
+	}
+}
+
+/* Bring in and write back the registers the block uses */
+static void jit_load(struct jit *j)
+{
+	uint8_t *skip;
+
+	if (j->regs & JR_A)
+		x_ld8abs(j, J_A, &reg8[A]);
+	if (j->regs & JR_BC) {
+		x_ld16abs(j, J_BC, &reg8[B]);
+		x_swap16(j, J_BC);
+	}
+	if (j->regs & JR_DE) {
+		x_ld16abs(j, J_DE, &reg8[D]);
+		x_swap16(j, J_DE);
+	}
+	if (j->regs & JR_HL) {
+		x_ld16abs(j, J_HL, &reg8[H]);
+		x_swap16(j, J_HL);
+	}
+	if (j->regs & JR_SP)
+		x_ld16abs(j, J_SP, &reg_SP);
+	if (j->regs & JR_F) {
+		/* Resolve any lazy flags left by the interpreter */
+		x_movabs(j, X_RAX, &lf_op);
+		x_cmpb0(j, X_RAX, X_NONE);
+		skip = x_jcc8(j, XC_Z);
+		x_call(j, flags_sync);
+		x_patch8(skip, j->p);
+		x_ld8abs(j, J_F, &reg8[FLAGS]);
+	}
+}
+
+static void jit_store_pair(struct jit *j, int pr, uint8_t *v)
+{
+	x_rr(j, X_MOV, X_RCX, pr);
+	x_swap16(j, X_RCX);
+	x_movabs(j, X_RAX, v);
+	emit8(j, 0x66);
+	emit8(j, 0x89);
+	x_modrm(j, 0, X_RCX, X_RAX);
+}
+
+static void jit_store(struct jit *j)
+{
+	if (j->regs & JR_A)
+		x_st8abs(j, J_A, &reg8[A]);
+	if (j->regs & JR_BC)
+		jit_store_pair(j, J_BC, &reg8[B]);
+	if (j->regs & JR_DE)
+		jit_store_pair(j, J_DE, &reg8[D]);
+	if (j->regs & JR_HL)
+		jit_store_pair(j, J_HL, &reg8[H]);
+	if (j->regs & JR_SP)
+		x_st16abs(j, J_SP, &reg_SP);
+	if (j->regs & JR_F) {
+		x_st8abs(j, J_F, &reg8[FLAGS]);
+		x_st8iabs(j, &lf_op, LF_NONE);
+	}
+}
+
+/* Write to memory from the slow path */
+static void jit_write(uint16_t addr, uint8_t val)
+{
+	mem_write(addr, val);
+}
+
+/* Read the byte at esi into eax. Uses rcx and rdx */
+static void jit_read(struct jit *j)
+{
+	struct jit_slow *s = j->slow + j->nslow++;
+
+	x_rr(j, X_MOV, X_RAX, X_RSI);
+	x_shift(j, XS_SHR, X_RAX, 8);
+	x_movabs(j, X_RDX, mem_rpage);
+	x_ldptr(j, X_RDX, X_RDX, X_RAX);
+	x_rex(j, 1, X_RDX, 0, X_RDX, 0);	/* test rdx,rdx */
+	emit8(j, X_TEST);
+	x_modrm(j, 3, X_RDX, X_RDX);
+	s->from[0] = x_jcc(j, XC_Z);
+	s->from[1] = NULL;
+	x_movzx8(j, X_RCX, X_RSI);
+	x_ld8(j, X_RAX, X_RDX, X_RCX);
+	s->back = j->p;
+	s->write = 0;
+}
+
+/* Write cl to the address in esi. Uses rax, rdx and rdi */
+static void jit_write8(struct jit *j)
+{
+	struct jit_slow *s = j->slow + j->nslow++;
+
+	x_rr(j, X_MOV, X_RAX, X_RSI);
+	x_shift(j, XS_SHR, X_RAX, 8);
+	x_movabs(j, X_RDX, mem_wpage);
+	x_ldptr(j, X_RDX, X_RDX, X_RAX);
+	x_rex(j, 1, X_RDX, 0, X_RDX, 0);	/* test rdx,rdx */
+	emit8(j, X_TEST);
+	x_modrm(j, 3, X_RDX, X_RDX);
+	s->from[0] = x_jcc(j, XC_Z);
+	x_movzx8(j, X_RDI, X_RSI);
+	x_st8(j, X_RCX, X_RDX, X_RDI);
+	/* Code in this page? Then the slow path sorts out the cache */
+	x_movabs(j, X_RDX, code_live);
+	x_cmpb0(j, X_RDX, X_RAX);
+	s->from[1] = x_jcc(j, XC_NZ);
+	s->back = j->p;
+	s->write = 1;
+}
+
+/* The out of line half of each memory access. Only r8 of the caller
+   saved registers is in use, and is saved twice to keep the stack
+   aligned */
+static void jit_slow_paths(struct jit *j)
+{
+	struct jit_slow *s;
+	unsigned int i;
+
+	for (i = 0; i < j->nslow; i++) {
+		s = j->slow + i;
+		x_patch(s->from[0], j->p);
+		if (s->from[1])
+			x_patch(s->from[1], j->p);
+		x_push(j, J_F);
+		x_push(j, J_F);
+		x_rr(j, X_MOV, X_RDI, X_RSI);
+		if (s->write) {
+			x_rr(j, X_MOV, X_RSI, X_RCX);
+			x_call(j, (jit_fn_t)jit_write);
+		} else {
+			x_call(j, (jit_fn_t)i8085_read);
+			x_movzx8(j, X_RAX, X_RAX);
+		}
+		x_pop(j, J_F);
+		x_pop(j, J_F);
+		x_patch(x_jmp(j), s->back);
+	}
+}
+
+/* Push the 16 bit value in ecx, or a constant */
+static void jit_push(struct jit *j, int reg, int val)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2; i++) {
+		x_ri(j, XI_SUB, J_SP, 1);
+		x_movzx16(j, J_SP, J_SP);
+		x_rr(j, X_MOV, X_RSI, J_SP);
+		if (reg < 0)
+			x_movi(j, X_RCX, i ? val & 0xFF : val >> 8);
+		else if (i)
+			x_movzx8(j, X_RCX, reg);
+		else {
+			x_rr(j, X_MOV, X_RCX, reg);
+			x_shift(j, XS_SHR, X_RCX, 8);
+		}
+		jit_write8(j);
+	}
+}
+
+/* Pop into a register pair, or into reg_PC if reg is negative */
+static void jit_pop(struct jit *j, int reg)
+{
+	unsigned int i;
+
+	for (i = 0; i < 2; i++) {
+		x_rr(j, X_MOV, X_RSI, J_SP);
+		jit_read(j);
+		if (reg < 0) {
+			x_rr(j, X_MOV, X_RCX, X_RAX);
+			x_st8abs(j, X_RCX, (uint8_t *)&reg_PC + i);
+		} else if (i == 0) {
+			x_ri(j, XI_AND, reg, 0xFF00);
+			x_rr(j, X_OR, reg, X_RAX);
+		} else {
+			x_shift(j, XS_SHL, X_RAX, 8);
+			x_ri(j, XI_AND, reg, 0xFF);
+			x_rr(j, X_OR, reg, X_RAX);
+		}
+		x_ri(j, XI_ADD, J_SP, 1);
+		x_movzx16(j, J_SP, J_SP);
 	}
 }
 
-void calc_AC_carry(uint8_t val1, uint8_t val2) {
-	if (((val1 & 0x0F) + (val2 & 0x0F)) >= 0x0F) {
-		set_AC();
-	} else {
-		clear_AC();
-	}
+/* Set the flags from a table entry indexed by eax, keeping those bits of
+   the old flags given by keep */
+static void jit_flags(struct jit *j, const uint8_t *table, uint8_t keep)
+{
+	x_movabs(j, X_RSI, table);
+	x_ld8(j, X_RAX, X_RSI, X_RAX);
+	x_ri(j, XI_AND, J_F, keep);
+	x_rr(j, X_OR, J_F, X_RAX);
 }
 
-void calc_subAC(int8_t val1, uint8_t val2) {
-	if ((val2 & 0x0F) <= (val1 & 0x0F)) {
-		set_AC();
-	} else {
-		clear_AC();
+/* An ALU operation on A and the value in ecx */
+static void jit_alu(struct jit *j, int n, int flags)
+{
+	/* ADD ADC SUB SBB ANA XRA ORA CMP */
+	static const uint8_t xop[8] = {
+		X_ADD, X_ADD, X_SUB, X_SUB, X_AND, X_XOR, X_OR, 0
+	};
+
+	/* The flags for ADD, ADC, SUB, SBB and CMP come from the operands */
+	if (n == 1 || n == 3) {		/* Carry in for ADC and SBB */
+		x_rr(j, X_MOV, X_RDX, J_F);
+		x_ri(j, XI_AND, X_RDX, 1);
+	}
+	if (n == 4 && flags) {		/* ANA sets AC from bit 3 */
+		x_rr(j, X_MOV, X_RDI, J_A);
+		x_rr(j, X_OR, X_RDI, X_RCX);
+		x_ri(j, XI_AND, X_RDI, 0x08);
+		x_rr(j, X_ADD, X_RDI, X_RDI);
+	}
+	if ((n < 4 || n == 7) && flags) {
+		x_rr(j, X_MOV, X_RAX, J_A);
+		x_shift(j, XS_SHL, X_RAX, 8);
+		x_rr(j, X_OR, X_RAX, X_RCX);
+		if (n == 1 || n == 3) {
+			x_rr(j, X_MOV, X_RSI, X_RDX);
+			x_shift(j, XS_SHL, X_RSI, 16);
+			x_rr(j, X_OR, X_RAX, X_RSI);
+		}
+		jit_flags(j, n < 2 ? add_flags[0] : sub_flags[0], 0x08);
+	}
+	if (xop[n]) {
+		x_rr(j, xop[n], J_A, X_RCX);
+		if (n == 1 || n == 3)
+			x_rr(j, xop[n], J_A, X_RDX);
+		if (n < 4)
+			x_movzx8(j, J_A, J_A);
+	}
+	if (n >= 4 && n < 7 && flags) {
+		x_rr(j, X_MOV, X_RAX, J_A);
+		jit_flags(j, logic_flags, 0x08);
+		if (n == 4)
+			x_rr(j, X_OR, J_F, X_RDI);
 	}
 }
 
-void calc_subAC_borrow(int8_t val1, uint8_t val2) {
-	if ((val2 & 0x0F) < (val1 & 0x0F)) {
-		set_AC();
-	} else {
-		clear_AC();
+/* INR or DCR of the value in ecx */
+static void jit_incdec(struct jit *j, int dec, int flags)
+{
+	if (flags) {
+		x_rr(j, X_MOV, X_RAX, X_RCX);
+		jit_flags(j, dec ? dcr_flags : inr_flags, 0x09);
 	}
+	x_ri(j, dec ? XI_SUB : XI_ADD, X_RCX, 1);
+	x_movzx8(j, X_RCX, X_RCX);
 }
 
-void calc_Vadd(int8_t val1, int8_t val2, int c)
+/* INX or DCX of a host register, setting V and K as the 8085 does */
+static void jit_incdec16(struct jit *j, int reg, int dec, int flags)
 {
-	/* Did adding bits 0-6 together carry into bit 7 ? */
-	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + c) & 0x80;
-	/* Did adding bits 0-7 together carry into bit 8 ? */
-	uint16_t c7 = ((uint16_t)val1 + val2 + c) & 0x100;
-	/* V is the xor of the two carries */
-	/* Annoying C has no ^^ operator */
-	if ((!!c6) ^ (!!c7))
-		set_V();
-	else
-		clear_V();
+	uint8_t *skip;
+
+	x_ri(j, dec ? XI_SUB : XI_ADD, reg, 1);
+	x_movzx16(j, reg, reg);
+	if (!flags)
+		return;
+	x_ri(j, XI_AND, J_F, 0xDD);
+	x_ri(j, XI_CMP, reg, dec ? 0x7FFF : 0x8000);
+	skip = x_jcc8(j, XC_NZ);
+	x_ri(j, XI_OR, J_F, 0x02);
+	x_patch8(skip, j->p);
+	x_ri(j, XI_CMP, reg, dec ? 0xFFFF : 0);
+	skip = x_jcc8(j, XC_NZ);
+	x_ri(j, XI_OR, J_F, 0x20);
+	x_patch8(skip, j->p);
 }
 
-/* 16bit maths is actually 8bit maths done twice */
-void calc_Vadd16(int16_t val1, int16_t val2)
+/* Jump to the common exit if the condition of op fails, having set the
+   PC to fall through. Returns so the taken path can follow */
+static void jit_cond(struct jit *j, const struct i8085_op *op, uint16_t next)
 {
-	/* Internal carry of the first add */
-	int c = ((val1 & 0xFF) + (val2 & 0xFF)) & 0x100;
-	/* Fed into the carry of the following adc */
-	calc_Vadd(val1 >> 8, val2 >> 8, !!c);
+	uint8_t *skip;
+
+	x_testb(j, J_F, op->r1);
+	skip = x_jcc8(j, op->r2 ? XC_NZ : XC_Z);
+	x_st16iabs(j, &reg_PC, next);
+	j->done[j->ndone++] = x_jmp(j);
+	x_patch8(skip, j->p);
 }
 
-void calc_Vsub(int8_t val1, int8_t val2, int c)
+/*
+ *	How each instruction uses the flags, for working out which flag
+ *	results are needed. FL_SET ops replace them all (bar bit 3, which
+ *	nothing but a flags load changes), FL_PART change some, FL_READ use
+ *	them and FL_CARRY use the carry and replace the rest.
+ */
+#define FL_NONE		0
+#define FL_SET		1
+#define FL_PART		2
+#define FL_READ		3
+#define FL_CARRY	4
+
+/* Which handlers are generated inline, and their flag use */
+static int jit_inline(i8085_handler_t fn, int *fl)
 {
-	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - c) & 0x80;
-	uint16_t c7 = ((val1 - val2 - c) & 0x100) >> 1;
-	if (c6 ^ c7)
-		set_V();
-	else
-		clear_V();
+	static const struct {
+		i8085_handler_t fn;
+		uint8_t fl;
+	} ops[] = {
+		{ op_nop, FL_NONE },	{ op_mov, FL_NONE },
+		{ op_mov_rm, FL_NONE },	{ op_mov_mr, FL_NONE },
+		{ op_mvi, FL_NONE },	{ op_mvi_m, FL_NONE },
+		{ op_lxi, FL_NONE },	{ op_lxi_sp, FL_NONE },
+		{ op_ldax, FL_NONE },	{ op_stax, FL_NONE },
+		{ op_lda, FL_NONE },	{ op_sta, FL_NONE },
+		{ op_lhld, FL_NONE },	{ op_shld, FL_NONE },
+		{ op_xchg, FL_NONE },	{ op_sphl, FL_NONE },
+		{ op_cma, FL_NONE },	{ op_push, FL_NONE },
+		{ op_pop, FL_NONE },	{ op_jmp, FL_NONE },
+		{ op_call, FL_NONE },	{ op_ret, FL_NONE },
+		{ op_rst, FL_NONE },	{ op_pchl, FL_NONE },
+		{ op_jcc, FL_READ },	{ op_ccc, FL_READ },
+		{ op_rcc, FL_READ },
+		{ op_inr, FL_PART },	{ op_inr_m, FL_PART },
+		{ op_dcr, FL_PART },	{ op_dcr_m, FL_PART },
+		{ op_inx, FL_PART },	{ op_inx_sp, FL_PART },
+		{ op_dcx, FL_PART },	{ op_dcx_sp, FL_PART },
+		{ op_stc, FL_PART },	{ op_cmc, FL_PART },
+		{ op_dad, FL_PART },	{ op_dad_sp, FL_PART },
+	};
+	unsigned int i;
+
+	for (i = 0; i < 8; i++) {
+		if (fn == alu_r[i] || fn == alu_m[i] || fn == alu_i[i]) {
+			*fl = (i == 1 || i == 3) ? FL_CARRY : FL_SET;
+			return 1;
+		}
+	}
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+		if (ops[i].fn == fn) {
+			*fl = ops[i].fl;
+			return 1;
+		}
+	}
+	*fl = FL_READ;
+	return 0;
 }
 
-void calc_Vsub16(int16_t val1, int16_t val2)
+/* Handlers that may be called part way through a block, and their
+   cycle counts. Everything else that isn't inline ends a block */
+static int jit_handler_cycles(i8085_handler_t fn)
 {
-	int c = (val1 & 0xFF) < (val2 & 0xFF);
-	calc_Vsub(val1 >> 8, val2 >> 8, c);
+	static const struct {
+		i8085_handler_t fn;
+		uint8_t cycles;
+	} ops[] = {
+		{ op_daa, 4 },		{ op_rlc, 4 },		{ op_rrc, 4 },
+		{ op_ral, 4 },		{ op_rar, 4 },		{ op_dsub, 10 },
+		{ op_arhl, 7 },		{ op_rdel, 10 },	{ op_ldhi, 10 },
+		{ op_ldsi, 10 },	{ op_xthl, 16 },	{ op_lhlx, 10 },
+		{ op_shlx, 10 },	{ op_push_psw, 12 },	{ op_pop_psw, 10 },
+		{ op_dad, 10 },		{ op_dad_sp, 10 }
+	};
+	unsigned int i;
+
+	for (i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
+		if (ops[i].fn == fn)
+			return ops[i].cycles;
+	return -1;
 }
 
-void calc_K(int8_t r)
+/* Instructions that write to memory */
+static int jit_writes(i8085_handler_t fn)
 {
-	if ((!!test_V()) ^ !!(r & 0x80))
-		set_K();
-	else
-		clear_K();
+	return fn == op_mov_mr || fn == op_mvi_m || fn == op_stax ||
+		fn == op_sta || fn == op_shld || fn == op_inr_m ||
+		fn == op_dcr_m || fn == op_push;
 }
 
-void calc_KVlogic(uint8_t val)
+/* The registers an inline instruction uses */
+static unsigned int jit_uses(const struct i8085_op *op)
 {
-	clear_V();
-	calc_K(val);
-}
+	i8085_handler_t fn = op->fn;
+	unsigned int n;
 
-uint8_t test_cond(uint8_t code) {
-	switch (code) {
-		case 0: //Z not set
-			if (!test_Z()) return 1; else return 0;
-		case 1: //Z set
-			if (test_Z()) return 1; else return 0;
-		case 2: //C not set
-			if (!test_C()) return 1; else return 0;
-		case 3: //C set
-			if (test_C()) return 1; else return 0;
-		case 4: //P not set
-			if (!test_P()) return 1; else return 0;
-		case 5: //P set
-			if (test_P()) return 1; else return 0;
-		case 6: //S not set
-			if (!test_S()) return 1; else return 0;
-		case 7: //S set
-			if (test_S()) return 1; else return 0;
+	for (n = 0; n < 8; n++) {
+		if (fn == alu_r[n])
+			return JR_A | jit_reg_mask(op->r2);
+		if (fn == alu_m[n])
+			return JR_A | JR_HL;
+		if (fn == alu_i[n])
+			return JR_A;
 	}
+	if (fn == op_mov)
+		return jit_reg_mask(op->r1) | jit_reg_mask(op->r2);
+	if (fn == op_mov_rm || fn == op_inr_m || fn == op_dcr_m)
+		return jit_reg_mask(op->r1) | JR_HL;
+	if (fn == op_mov_mr)
+		return jit_reg_mask(op->r2) | JR_HL;
+	if (fn == op_mvi || fn == op_inr || fn == op_dcr)
+		return jit_reg_mask(op->r1);
+	if (fn == op_mvi_m || fn == op_lhld || fn == op_shld || fn == op_pchl)
+		return JR_HL;
+	if (fn == op_lxi || fn == op_inx || fn == op_dcx)
+		return jit_pair_mask(op->r1);
+	if (fn == op_lxi_sp || fn == op_inx_sp || fn == op_dcx_sp)
+		return JR_SP;
+	if (fn == op_ldax || fn == op_stax)
+		return JR_A | jit_pair_mask(op->r1);
+	if (fn == op_lda || fn == op_sta || fn == op_cma)
+		return JR_A;
+	if (fn == op_xchg)
+		return JR_HL | JR_DE;
+	if (fn == op_sphl)
+		return JR_HL | JR_SP;
+	if (fn == op_push || fn == op_pop)
+		return jit_pair_mask(op->r1) | JR_SP;
+	if (fn == op_dad)
+		return JR_HL | jit_pair_mask(op->r1);
+	if (fn == op_dad_sp)
+		return JR_HL | JR_SP;
+	if (fn == op_call || fn == op_ret || fn == op_rst ||
+		fn == op_ccc || fn == op_rcc)
+		return JR_SP;
 	return 0;
 }
 
-void i8085_push(uint16_t value) {
-	i8085_write(--reg_SP, value >> 8);
-	i8085_write(--reg_SP, (uint8_t)value);
-}
+/* Generate one inline instruction. Returns the cycles it takes (the
+   untaken ones for a conditional branch) */
+static int jit_op(struct jit *j, const struct i8085_uop *u, int flags)
+{
+	const struct i8085_op *op = u->op;
+	i8085_handler_t fn = op->fn;
+	int n;
 
-uint16_t i8085_pop() {
-	uint16_t temp;
-	temp = i8085_read(reg_SP++);
-	temp |= (uint16_t)i8085_read(reg_SP++) << 8;
-	return temp;
+	for (n = 0; n < 8; n++) {
+		if (fn == alu_r[n] || fn == alu_m[n] || fn == alu_i[n]) {
+			if (fn == alu_r[n])
+				jit_get8(j, X_RCX, op->r2);
+			else if (fn == alu_i[n])
+				x_movi(j, X_RCX, u->imm & 0xFF);
+			else {
+				x_rr(j, X_MOV, X_RSI, J_HL);
+				jit_read(j);
+				x_rr(j, X_MOV, X_RCX, X_RAX);
+			}
+			jit_alu(j, n, flags);
+			return fn == alu_r[n] ? 4 : 7;
+		}
+	}
+	if (fn == op_nop)
+		return 4;
+	if (fn == op_mov) {
+		if (op->r1 != op->r2) {
+			jit_get8(j, X_RCX, op->r2);
+			jit_set8(j, op->r1, X_RCX);
+		}
+		return 4;
+	}
+	if (fn == op_mov_rm) {
+		x_rr(j, X_MOV, X_RSI, J_HL);
+		jit_read(j);
+		jit_set8(j, op->r1, X_RAX);
+		return 7;
+	}
+	if (fn == op_mov_mr) {
+		jit_get8(j, X_RCX, op->r2);
+		x_rr(j, X_MOV, X_RSI, J_HL);
+		jit_write8(j);
+		return 7;
+	}
+	if (fn == op_mvi) {
+		x_movi(j, X_RCX, u->imm & 0xFF);
+		jit_set8(j, op->r1, X_RCX);
+		return 7;
+	}
+	if (fn == op_mvi_m) {
+		x_movi(j, X_RCX, u->imm & 0xFF);
+		x_rr(j, X_MOV, X_RSI, J_HL);
+		jit_write8(j);
+		return 10;
+	}
+	if (fn == op_lxi || fn == op_lxi_sp) {
+		x_movi(j, jit_pair(op->r1), u->imm);
+		return 10;
+	}
+	if (fn == op_ldax || fn == op_lda) {
+		if (fn == op_lda)
+			x_movi(j, X_RSI, u->imm);
+		else
+			x_rr(j, X_MOV, X_RSI, jit_pair(op->r1));
+		jit_read(j);
+		x_rr(j, X_MOV, J_A, X_RAX);
+		return fn == op_lda ? 13 : 7;
+	}
+	if (fn == op_stax || fn == op_sta) {
+		x_rr(j, X_MOV, X_RCX, J_A);
+		if (fn == op_sta)
+			x_movi(j, X_RSI, u->imm);
+		else
+			x_rr(j, X_MOV, X_RSI, jit_pair(op->r1));
+		jit_write8(j);
+		return fn == op_sta ? 13 : 7;
+	}
+	if (fn == op_lhld) {
+		x_movi(j, X_RSI, u->imm);
+		jit_read(j);
+		jit_set8(j, L, X_RAX);
+		x_movi(j, X_RSI, (uint16_t)(u->imm + 1));
+		jit_read(j);
+		jit_set8(j, H, X_RAX);
+		return 16;
+	}
+	if (fn == op_shld) {
+		jit_get8(j, X_RCX, L);
+		x_movi(j, X_RSI, u->imm);
+		jit_write8(j);
+		jit_get8(j, X_RCX, H);
+		x_movi(j, X_RSI, (uint16_t)(u->imm + 1));
+		jit_write8(j);
+		return 16;
+	}
+	if (fn == op_xchg) {
+		x_rr(j, X_XCHG, J_HL, J_DE);
+		return 5;
+	}
+	if (fn == op_sphl) {
+		x_rr(j, X_MOV, J_SP, J_HL);
+		return 6;
+	}
+	if (fn == op_cma) {
+		x_ri(j, XI_XOR, J_A, 0xFF);
+		return 4;
+	}
+	if (fn == op_stc || fn == op_cmc) {
+		if (flags)
+			x_ri(j, fn == op_stc ? XI_OR : XI_XOR, J_F, 1);
+		return 4;
+	}
+	if (fn == op_inr || fn == op_dcr) {
+		jit_get8(j, X_RCX, op->r1);
+		jit_incdec(j, fn == op_dcr, flags);
+		jit_set8(j, op->r1, X_RCX);
+		return 4;
+	}
+	if (fn == op_inr_m || fn == op_dcr_m) {
+		x_rr(j, X_MOV, X_RSI, J_HL);
+		jit_read(j);
+		x_rr(j, X_MOV, X_RCX, X_RAX);
+		jit_incdec(j, fn == op_dcr_m, flags);
+		x_rr(j, X_MOV, X_RSI, J_HL);
+		jit_write8(j);
+		return 10;
+	}
+	if (fn == op_inx || fn == op_inx_sp || fn == op_dcx || fn == op_dcx_sp) {
+		jit_incdec16(j, jit_pair(op->r1),
+			fn == op_dcx || fn == op_dcx_sp, flags);
+		return 6;
+	}
+	if (fn == op_dad || fn == op_dad_sp) {
+		/* Only when the flags it sets aren't wanted */
+		x_rr(j, X_ADD, J_HL, jit_pair(op->r1));
+		x_movzx16(j, J_HL, J_HL);
+		return 10;
+	}
+	if (fn == op_push) {
+		jit_push(j, jit_pair(op->r1), 0);
+		return 12;
+	}
+	if (fn == op_pop) {
+		jit_pop(j, jit_pair(op->r1));
+		return 10;
+	}
+
+	/* The rest end the block and leave the PC set */
+	if (fn == op_jmp) {
+		x_st16iabs(j, &reg_PC, u->imm);
+		return 10;
+	}
+	if (fn == op_pchl) {
+		x_st16abs(j, J_HL, &reg_PC);
+		return 6;
+	}
+	if (fn == op_ret) {
+		jit_pop(j, -1);
+		return 10;
+	}
+	if (fn == op_call || fn == op_rst) {
+		jit_push(j, -1, u->pc);
+		x_st16iabs(j, &reg_PC, fn == op_call ? u->imm : op->r1);
+		return fn == op_call ? 18 : 12;
+	}
+	if (fn == op_jcc) {
+		jit_cond(j, op, u->pc);
+		x_ri(j, XI_SUB, J_CYC, 3);
+		x_st16iabs(j, &reg_PC, u->imm);
+		return 7;
+	}
+	if (fn == op_ccc) {
+		jit_cond(j, op, u->pc);
+		x_ri(j, XI_SUB, J_CYC, 9);
+		jit_push(j, -1, u->pc);
+		x_st16iabs(j, &reg_PC, u->imm);
+		return 9;
+	}
+	if (fn == op_rcc) {
+		jit_cond(j, op, u->pc);
+		x_ri(j, XI_SUB, J_CYC, 6);
+		jit_pop(j, -1);
+		return 6;
+	}
+	return -1;
 }
 
-void i8085_set_int(int n)
+/* Drop all generated code, used when the buffer fills up */
+static void jit_flush(void)
 {
-	intpend |= n;
+	unsigned int i;
+	for (i = 0; i < BLOCK_HASH; i++) {
+		blocks[i].native = NULL;
+		blocks[i].hits = 0;
+	}
+	jit_ptr = jit_buf;
 }
 
-void i8085_clear_int(int n)
+static int (*jit_compile(struct i8085_block *b))(int)
 {
-	intpend &= ~n;
-}
+	static const uint8_t save[] = { X_RBX, X_RBP, X_R12, X_R13, X_R14, X_R15 };
+	struct jit jit, *j = &jit;
+	const struct i8085_uop *u;
+	uint8_t need[BLOCK_UOPS], inl[BLOCK_UOPS];
+	uint8_t *start, *exit, *leave, *cyc;
+	int n, fl, live, cycles, used = 0;
+	unsigned int i;
 
+	if (jit_failed || mem_rpage == NULL || mem_wpage == NULL)
+		return NULL;
+	if (jit_buf == NULL) {
+		jit_buf = mmap(NULL, JIT_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (jit_buf == MAP_FAILED) {
+			jit_buf = NULL;
+			jit_failed = 1;
+			return NULL;
+		}
+		jit_ptr = jit_buf;
+	}
+	if (jit_ptr + JIT_BLOCK_MAX > jit_buf + JIT_SIZE)
+		jit_flush();
 
-void i8085_jump(uint16_t addr) {
-	reg_PC = addr;
-}
+	/* Work backwards to find which flag results are looked at. Leaving
+	   early after a write that hits cached code counts as a look */
+	live = 1;
+	j->regs = 0;
+	for (n = b->len - 1; n >= 0; n--) {
+		u = b->uop + n;
+		inl[n] = jit_inline(u->op->fn, &fl);
+		if (!inl[n] && !u->op->end && jit_handler_cycles(u->op->fn) < 0)
+			return NULL;
+		/* DAD inline doesn't do the flags */
+		if ((u->op->fn == op_dad || u->op->fn == op_dad_sp) && live) {
+			inl[n] = 0;
+			fl = FL_READ;
+		}
+		if (n < b->len - 1 && (!inl[n] || jit_writes(u->op->fn)))
+			live = 1;
+		need[n] = live;
+		if (fl == FL_SET)
+			live = 0;
+		else if (fl == FL_READ || fl == FL_CARRY)
+			live = 1;
+		if (inl[n]) {
+			j->regs |= jit_uses(u->op);
+			if (fl == FL_READ || fl == FL_CARRY || (fl != FL_NONE && need[n]))
+				j->regs |= JR_F;
+		}
+	}
 
-void i8085_reset() {
-	reg_PC = reg_SP = 0x0000;
-	//reg8[FLAGS] = 0x02;
-}
+	j->p = start = jit_ptr;
+	j->nslow = j->nexit = j->ndone = j->nleave = 0;
+	for (i = 0; i < sizeof(save); i++)
+		x_push(j, save[i]);
+	emit32(j, 0x08EC8348);			/* sub rsp,8 */
+	x_rr(j, X_MOV, J_CYC, X_RDI);
+	x_st8iabs(j, &block_stale, 0);
+	jit_load(j);
 
-void i8085_write_reg8(reg_t reg, uint8_t value) {
-	if (reg == M) {
-		i8085_write(reg16_HL, value);
-	} else {
-		reg8[reg] = value;
+	for (n = 0; n < b->len; n++) {
+		u = b->uop + n;
+		if (inl[n]) {
+			/* The count goes into the sub once it is known */
+			x_ri(j, XI_SUB, J_CYC, 0);
+			cyc = j->p - 1;
+			cycles = jit_op(j, u, need[n]);
+			*cyc = cycles;
+		} else {
+			cycles = jit_handler_cycles(u->op->fn);
+			jit_store(j);
+			x_st16iabs(j, &reg_PC, u->pc);
+			x_st32abs(j, J_CYC, &exec_left);
+			x_movabs(j, X_RDI, u->op);
+			x_movi(j, X_RSI, u->imm);
+			x_call(j, (jit_fn_t)u->op->fn);
+			x_rr(j, X_SUB, J_CYC, X_RAX);
+			if (u->op->end) {
+				/* Memory is up to date and the PC set */
+				j->leave[j->nleave++] = x_jmp(j);
+				break;
+			}
+			jit_load(j);
+		}
+		if (n < b->len - 1) {
+			used += cycles;
+			if (!inl[n] || jit_writes(u->op->fn)) {
+				x_movabs(j, X_RAX, &block_stale);
+				x_cmpb0(j, X_RAX, X_NONE);
+				j->exit[j->nexit] = x_jcc(j, XC_NZ);
+				j->exitpc[j->nexit++] = u->pc;
+			}
+		} else if (!u->op->end)
+			x_st16iabs(j, &reg_PC, u->pc);
 	}
-}
+	exit = j->p;
+	jit_store(j);
+	leave = j->p;
+	x_rr(j, X_MOV, X_RAX, J_CYC);
+	emit32(j, 0x08C48348);			/* add rsp,8 */
+	for (i = sizeof(save); i-- > 0; )
+		x_pop(j, save[i]);
+	emit8(j, 0xC3);				/* ret */
 
-uint8_t i8085_read_reg8(reg_t reg) {
-	if (reg == M) {
-		return i8085_read(reg16_HL);
-	} else {
-		return reg8[reg];
+	for (i = 0; i < j->ndone; i++)
+		x_patch(j->done[i], exit);
+	for (i = 0; i < j->nleave; i++)
+		x_patch(j->leave[i], leave);
+	/* Leaving early: set the PC and go */
+	for (i = 0; i < j->nexit; i++) {
+		x_patch(j->exit[i], j->p);
+		x_st16iabs(j, &reg_PC, j->exitpc[i]);
+		x_patch(x_jmp(j), exit);
 	}
+	jit_slow_paths(j);
+
+	jit_ptr = j->p;
+	b->need = used;
+	memcpy(&b->native, &start, sizeof(start));
+	return b->native;
 }
 
-uint16_t i8085_read_reg16(reg_t reg) {
-	switch (reg) {
-		case AF: return reg16_PSW;
-		case BC: return reg16_BC;
-		case DE: return reg16_DE;
-		case HL: return reg16_HL;
-		case SP: return reg_SP;
-		case PC: return reg_PC;
-		default:
-			fprintf(stderr, "bogus rr16\n");
-	}
-	return 0;
+#endif
+
+static int block_run(struct i8085_block *b, int cycles)
+{
+	const struct i8085_uop *u = b->uop;
+	const struct i8085_uop *end = u + b->len;
+
+#ifdef I8085_JIT
+	/* The native code needs enough cycles to get to the last op */
+	if (b->native == NULL && ++b->hits == JIT_HOT)
+		jit_compile(b);
+	if (b->native && cycles > b->need)
+		return b->native(cycles);
+#endif
+
+	block_stale = 0;
+	do {
+		reg_PC = u->pc;
+		exec_left = cycles;
+		cycles -= u->op->fn(u->op, u->imm);
+		u++;
+	} while (u < end && cycles > 0 && !block_stale);
+	return cycles;
 }
 
-void i8085_write_reg16(reg_t reg, uint16_t value) {
-	switch (reg) {
-		case AF: reg8[A] = value>>8; reg8[FLAGS] = value; break;
-		case BC: reg8[B] = value>>8; reg8[C] = value; break;
-		case DE: reg8[D] = value>>8; reg8[E] = value; break;
-		case HL: reg8[H] = value>>8; reg8[L] = value; break;
-		case SP: reg_SP = value; break;
-		case PC: reg_PC = value; break;
-		default:
-			fprintf(stderr, "bogus rr16\n");
+/* True if an interrupt would be taken at the next instruction */
+#define int_ready()	((intpend & INT_NMI) || (INTE && (intpend & ~reg_IM)))
+
+/*
+ *	The CPU loop is instantiated twice, with and without the instruction
+ *	log, so that normal running doesn't test i8085_log every instruction.
+ *	The choice is made on each call to i8085_exec.
+ */
+#ifdef __GNUC__
+#define always_inline inline __attribute__((always_inline))
+#else
+#define always_inline inline
+#endif
+
+static always_inline int i8085_run(int cycles, int logging)
+{
+	const struct i8085_op *op;
+	struct i8085_block *b;
+	uint16_t imm;
+	uint8_t opcode;
+
+	while (cycles > 0 && !yield) {
+		cycles -= i8085_interrupt();
+		intprotect = 0;
+		halted = 0;
+
+		/* The log wants to see every instruction so doesn't use the
+		   block cache */
+		if (!logging && code_cache && !int_ready()) {
+			b = block_get();
+			if (b) {
+				cycles = block_run(b, cycles);
+				continue;
+			}
+		}
+
+		opcode = i8085_read(reg_PC);
+		if (logging)
+			i8085_trace();
+		reg_PC++;
+
+		op = optab + opcode;
+		imm = 0;
+		if (op->len) {
+			imm = i8085_read(reg_PC);
+			if (op->len == 2)
+				imm |= (uint16_t)i8085_read(reg_PC + 1) << 8;
+			reg_PC += op->len;
+		}
+		exec_left = cycles;
+		cycles -= op->fn(op, imm);
 	}
+	return cycles;
 }
 
-static char *i8085_flags(uint8_t v)
+static int i8085_run_log(int cycles)
 {
-	static char buf[9];
-	char *fp = "SZKA-PVC";
-	char *t = buf;
+	return i8085_run(cycles, 1);
+}
 
-	strcpy(buf, "--------");
+static int i8085_run_fast(int cycles)
+{
+	return i8085_run(cycles, 0);
+}
 
-	while(*fp) {
-		if (v & 0x80)
-			*t = *fp;
-		t++;
-		fp++;
-		v <<= 1;
-	}
-	return buf;
+int i8085_exec(int cycles) {
+	yield = 0;
+	if (!optab_ready)
+		i8085_build_optab();
+	exec_start = exec_left = cycles;
+	if (i8085_log)
+		cycles = i8085_run_log(cycles);
+	else
+		cycles = i8085_run_fast(cycles);
+	exec_start = exec_left = 0;
+	return cycles;
 }
 
+#else
+
 int i8085_exec(int cycles) {
-	uint8_t opcode, temp8, reg, reg2;
+	uint8_t opcode;
+	uint8_t temp8, reg, reg2;
 	uint16_t temp16;
-	uint32_t temp32;
-	uint8_t vec;
-
-	while (cycles > 0) {
-		/* TRAP is edge and level - must see the edge and it held */
-		if (intpend & INT_NMI) {	/* TRAP - NMI */
-			INTE = 0;
-			intpend &= ~8;
-			if (halted)
-				i8085_push(reg_PC + 1);
-			else
-				i8085_push(reg_PC);
-			reg_PC = 0x24;
-			cycles -= 12; /* Check me */
-			if (i8085_log)
-				fprintf(i8085_log, "NMI taken.\n");
-		/* The others are level except 0x3C which is positive edge.
-		   The 8085 prioritizes so we must do likewise */
-		} else if (INTE && intprotect == 0 && (intpend & ~reg_IM)) {
-			INTE = 0;
-			temp8 = intpend & ~reg_IM;
-
-			if (i8085_log)
-				fprintf(i8085_log, "IRQ taken (%x)\n", temp8);
-
-			if (temp8 & INT_RST75) {
-				/* FIXME: we should temporarily mask not
-				   clear here. We clear in SIM */
-				vec = 0x3C;
-				intpend &= ~INT_RST75;
-			} else if (temp8 & INT_RST65)
-				vec = 0x34;
-			else if (temp8 & INT_RST55)
-				vec = 0x2C;
-			else
-				vec = 0x38;
-			if (halted)
-				i8085_push(reg_PC + 1);
-			else
-				i8085_push(reg_PC);
-			reg_PC = vec;
-			cycles -= 12;	/* Check me */
-		}
+
+	yield = 0;
+	exec_start = exec_left = cycles;
+
+	while (cycles > 0 && !yield) {
+		cycles -= i8085_interrupt();
 		intprotect = 0;
 		halted = 0;
+		exec_left = cycles;
 
 		opcode = i8085_read(reg_PC);
 		
 		if (i8085_log)
-			fprintf(i8085_log, "%04X : %02x %02X %02X : %6s %02X %04X %04X %04X %04X\n",
-				reg_PC, i8085_debug_read(reg_PC), i8085_debug_read(reg_PC + 1), i8085_debug_read(reg_PC + 2),
-				i8085_flags(reg8[FLAGS]), reg8[A], reg16_BC, reg16_DE, reg16_HL, reg_SP);
+			i8085_trace();
 		
 		reg_PC++;
 
@@ -443,7 +2824,7 @@ int i8085_exec(int cycles) {
 				break;
 			case 0x32: //STA a - store A to memory
 				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16, reg8[A]);
+				mem_write(temp16, reg8[A]);
 				reg_PC += 2;
 				cycles -= 13;
 				break;
@@ -456,8 +2837,8 @@ int i8085_exec(int cycles) {
 				break;
 			case 0x22: //SHLD a - store H:L to memory
 				temp16 = (uint16_t)i8085_read(reg_PC) | ((uint16_t)i8085_read(reg_PC+1)<<8);
-				i8085_write(temp16++, reg8[L]);
-				i8085_write(temp16, reg8[H]);
+				mem_write(temp16++, reg8[L]);
+				mem_write(temp16, reg8[H]);
 				reg_PC += 2;
 				cycles -= 16;
 				break;
@@ -471,38 +2852,15 @@ int i8085_exec(int cycles) {
 				cycles -= 5;
 				break;
 			case 0xC6: //ADI # - add immediate to A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_add(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xCE: //ACI # - add immediate to A with carry
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
-				/* The carry out is computed including the
-				   carry in of the bit before */
-				calc_Vadd(reg8[A], temp8, test_C());
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_adc(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xD6: //SUI # - subtract immediate from A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_sub(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0x27: //DAA - decimal adjust accumulator
@@ -529,49 +2887,23 @@ int i8085_exec(int cycles) {
 				cycles -= 4;
 				break;
 			case 0xE6: //ANI # - AND immediate with A
-				temp8 = i8085_read(reg_PC++);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_ana(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xF6: //ORI # - OR immediate with A
-				reg8[A] |= i8085_read(reg_PC++);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_ora(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xEE: //XRI # - XOR immediate with A
-				reg8[A] ^= i8085_read(reg_PC++);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_xra(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xDE: //SBI # - subtract immediate from A with borrow
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K((uint8_t)temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_sbb(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0xFE: //CPI # - compare immediate with A
-				temp8 = i8085_read(reg_PC++);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K((uint8_t)temp16);
+				alu_cmp(i8085_read(reg_PC++));
 				cycles -= 7;
 				break;
 			case 0x07: //RLC - rotate A left
@@ -610,7 +2942,7 @@ int i8085_exec(int cycles) {
 				/* This does not affect flags */
 				break;
 			case 0x3F: //CMC - complement carry flag
-				reg8[FLAGS] ^= 1;
+				*flagp() ^= 1;
 				cycles -= 4;
 				break;
 			case 0x37: //STC - set carry flag
@@ -813,11 +3145,11 @@ int i8085_exec(int cycles) {
 				cycles -= 7;
 				break;
 			case 0x02: //STAX BC - store A indirect through BC
-				i8085_write(reg16_BC, reg8[A]);
+				mem_write(reg16_BC, reg8[A]);
 				cycles -= 7;
 				break;
 			case 0x12: //STAX DE - store A indirect through DE
-				i8085_write(reg16_DE, reg8[A]);
+				mem_write(reg16_DE, reg8[A]);
 				cycles -= 7;
 				break;
 			case 0x04: //INR D - increment register
@@ -829,15 +3161,7 @@ int i8085_exec(int cycles) {
 			case 0x2C:
 			case 0x3C:
 				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_AC(temp8, 1);
-				calc_SZP(temp8 + 1);
-				if (temp8 == 0x7F)
-					set_V();
-				else
-					clear_V();
-				calc_K(temp8+1);
-				i8085_write_reg8(reg, temp8 + 1); //reg8[reg]++;
+				i8085_write_reg8(reg, alu_inr(i8085_read_reg8(reg)));
 				if (reg == M) {
 					cycles -= 10;
 				} else {
@@ -853,15 +3177,7 @@ int i8085_exec(int cycles) {
 			case 0x2D:
 			case 0x3D:
 				reg = (opcode >> 3) & 7;
-				temp8 = i8085_read_reg8(reg); //reg8[reg];
-				calc_subAC(temp8, 1);
-				calc_SZP(temp8 - 1);
-				if (temp8 == 0x80)
-					set_V();
-				else
-					clear_V();
-				calc_K(temp8 - 1);
-				i8085_write_reg8(reg, temp8 - 1); //reg8[reg]--;
+				i8085_write_reg8(reg, alu_dcr(i8085_read_reg8(reg)));
 				if (reg == M) {
 					cycles -= 10;
 				} else {
@@ -873,16 +3189,7 @@ int i8085_exec(int cycles) {
 			case 0x23:
 			case 0x33:
 				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) + 1;
-				if (temp16 == 0x8000)
-					set_V();
-				else
-					clear_V();
-				if (temp16 == 0x0000)
-					set_K();
-				else
-					clear_K();
-				write16_RP(reg, temp16);
+				write16_RP(reg, alu_inx(read_RP(reg)));
 				cycles -= 6;
 				break;
 			case 0x0B: //DCX RP - decrement register pair
@@ -890,16 +3197,7 @@ int i8085_exec(int cycles) {
 			case 0x2B:
 			case 0x3B:
 				reg = (opcode >> 4) & 3;
-				temp16 = read_RP(reg) - 1;
-				if (temp16 == 0x7FFF)
-					set_V();
-				else
-					clear_V();
-				if (temp16 == 0xFFFF)
-					set_K();
-				else
-					clear_K();
-				write16_RP(reg, temp16);
+				write16_RP(reg, alu_dcx(read_RP(reg)));
 				cycles -= 6;
 				break;
 			case 0x09: //DAD RP - add register pair to HL
@@ -907,11 +3205,7 @@ int i8085_exec(int cycles) {
 			case 0x29:
 			case 0x39:
 				reg = (opcode >> 4) & 3;
-				calc_Vadd16(reg16_HL, read_RP(reg));
-				temp32 = (uint32_t)reg16_HL + (uint32_t)read_RP(reg);
-				write16_RP(2, (uint16_t)temp32);
-				if (temp32 & 0xFFFF0000) set_C(); else clear_C();
-				calc_K(temp32 >> 8);;
+				alu_dad(read_RP(reg));
 				cycles -= 10;
 				break;
 			case 0x80: //ADD S - add register or memory to A
@@ -923,14 +3217,7 @@ int i8085_exec(int cycles) {
 			case 0x86:
 			case 0x87:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8;
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_AC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vadd(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_add(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -946,14 +3233,7 @@ int i8085_exec(int cycles) {
 			case 0x8E:
 			case 0x8F:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] + (uint16_t)temp8 + (uint16_t)test_C();
-				if (test_C()) calc_AC_carry(reg8[A], temp8); else calc_AC(reg8[A], temp8);
-				calc_Vadd(reg8[A], temp8, test_C());
-				if (temp16 & 0xFF00) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_adc(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -969,14 +3249,7 @@ int i8085_exec(int cycles) {
 			case 0x96:
 			case 0x97:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_sub(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -992,14 +3265,7 @@ int i8085_exec(int cycles) {
 			case 0x9E:
 			case 0x9F:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8 - (uint16_t)test_C();
-				if (test_C()) calc_subAC_borrow(reg8[A], temp8); else calc_subAC(reg8[A], temp8);
-				calc_Vsub(reg8[A], temp8, test_C());
-				if (((temp16 & 0x00FF) >= reg8[A]) && (temp8 | test_C())) set_C(); else clear_C();
-				calc_SZP((uint8_t)temp16);
-				calc_K(temp16);
-				reg8[A] = (uint8_t)temp16;
+				alu_sbb(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -1015,12 +3281,7 @@ int i8085_exec(int cycles) {
 			case 0xA6:
 			case 0xA7:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				if ((reg8[A] | temp8) & 0x08) set_AC(); else clear_AC();
-				reg8[A] &= temp8;
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_ana(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -1036,11 +3297,7 @@ int i8085_exec(int cycles) {
 			case 0xB6:
 			case 0xB7:
 				reg = opcode & 7;
-				reg8[A] |= i8085_read_reg8(reg);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_ora(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -1056,11 +3313,7 @@ int i8085_exec(int cycles) {
 			case 0xAE:
 			case 0xAF:
 				reg = opcode & 7;
-				reg8[A] ^= i8085_read_reg8(reg);
-				clear_AC();
-				clear_C();
-				calc_SZP(reg8[A]);
-				calc_KVlogic(reg8[A]);
+				alu_xra(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -1076,13 +3329,7 @@ int i8085_exec(int cycles) {
 			case 0xBE:
 			case 0xBF:
 				reg = opcode & 7;
-				temp8 = i8085_read_reg8(reg);
-				temp16 = (uint16_t)reg8[A] - (uint16_t)temp8;
-				if (((temp16 & 0x00FF) >= reg8[A]) && temp8) set_C(); else clear_C();
-				calc_subAC(reg8[A], temp8);
-				calc_SZP((uint8_t)temp16);
-				calc_Vsub(reg8[A], temp8, 0);
-				calc_K(temp16);
+				alu_cmp(i8085_read_reg8(reg));
 				if (reg == M) {
 					cycles -= 7;
 				} else {
@@ -1161,8 +3408,8 @@ int i8085_exec(int cycles) {
 				}
 				break;
 			case 0xD9: //SHLX
-				i8085_write(reg16_DE, reg8[L]);
-				i8085_write(reg16_DE+1, reg8[H]);
+				mem_write(reg16_DE, reg8[L]);
+				mem_write(reg16_DE+1, reg8[H]);
 				cycles -= 10;
 				break;
 			case 0xC9: //RET - unconditional return
@@ -1205,7 +3452,9 @@ int i8085_exec(int cycles) {
 				printf("UNRECOGNIZED INSTRUCTION @ %04Xh: %02X\n", reg_PC - 1, opcode);
 				exit(0);
 		}
-
 	}
+	exec_start = exec_left = 0;
 	return cycles;
 }
+
+#endif
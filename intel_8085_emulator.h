@@ -37,7 +37,22 @@ extern void i8085_write_reg16(reg_t reg, uint16_t value);
 extern void i8085_reset();
 
 extern int i8085_exec(int cycles);
-
-FILE *i8085_log;
+extern void i8085_yield(void);
+extern int i8085_elapsed(void);
+
+/* Code cache support. Memory below common belongs to the given bank and
+   is cached separately for each bank. Memory changed other than by the
+   CPU (eg by DMA) must be reported with i8085_code_invalidate */
+extern void i8085_set_bank(uint8_t bank, uint16_t common);
+extern void i8085_code_invalidate(uint16_t addr);
+extern void i8085_code_cache(int enable);
+
+/* The host's memory map as two tables of 256 byte pages, one for reads
+   and one for writes. A NULL entry means that page must go through
+   i8085_read or i8085_write. The tables are looked at on every access so
+   may be changed at any time. Optional, used by the code generator */
+extern void i8085_set_pages(uint8_t **rpage, uint8_t **wpage);
+
+extern FILE *i8085_log;
 
 #endif
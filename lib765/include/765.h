@@ -167,6 +167,42 @@ void	 fdd_setfilename(FDRV_PTR fd, const char *s);
  * FDC. It is intended for use by administration interfaces */
 fd_err_t fdd_new_dsk(FDRV_PTR fd);
 
+/* Subclass of FLOPPY_DRIVE: a drive which emulates discs using CPCEMU 
+ * .DSK files, mapped into memory rather than read and written through 
+ * stdio */
+
+FDRV_PTR fd_newmdsk(void);
+
+/* Get / set DSK file associated with this drive.
+ * Note that doing fdm_setfilename() causes an implicit eject on the 
+ * previous disc in the drive. */
+char *   fdm_getfilename(FDRV_PTR fd);		
+void	 fdm_setfilename(FDRV_PTR fd, const char *s);
+
+/* Subclass of FLOPPY_DRIVE: a drive which emulates discs using raw images,
+ * which hold just the sector data of each track in turn */
+
+typedef struct fd_geometry
+{
+	int fg_cylinders;	/* Cylinders in the image */
+	int fg_heads;		/* Heads (sides), 1 or 2 */
+	int fg_sectors;		/* Sectors per track */
+	int fg_secsize;		/* Bytes per sector, 128 << n */
+	int fg_secbase;		/* ID of the first sector on a track */
+} FD_GEOMETRY;
+
+FDRV_PTR fd_newraw(void);
+
+/* Get / set the image file associated with this drive.
+ * Note that doing fdr_setfilename() causes an implicit eject on the 
+ * previous disc in the drive. */
+char *   fdr_getfilename(FDRV_PTR fd);		
+void	 fdr_setfilename(FDRV_PTR fd, const char *s);
+/* Get / set the layout of the image. The default is 80 cylinders, 2 heads
+ * and 9 512-byte sectors numbered from 1. Returns -1 for a bad geometry */
+void     fdr_getgeometry(FDRV_PTR fd, FD_GEOMETRY *g);
+int      fdr_setgeometry(FDRV_PTR fd, const FD_GEOMETRY *g);
+
 
 #ifdef DSK_ERR_OK	/* LIBDSK headers included */
 /* Subclass of FLOPPY_DRIVE: a drive which emulates discs using LIBDSK
@@ -252,6 +288,8 @@ fdc_byte fd_changed(FDRV_PTR fd);
 int fd_dirty(FDRV_PTR fd);
 /* Eject the disc from the drive */
 void fd_eject(FDRV_PTR fd);
+/* Write back anything the drive has cached */
+void fd_flush(FDRV_PTR fd);
 /* Set the drive's data rate */
 void fd_set_datarate(FDRV_PTR fd, fdc_byte rate);
 /* Reset the drive */
@@ -155,6 +155,13 @@ void fd_eject(FDRV_PTR fd)
 	
 }
 
+/* Write back cached data */
+void fd_flush(FDRV_PTR fd)
+{
+	if (fd && (fd->fd_vtable->fdv_flush)) 
+		(*fd->fd_vtable->fdv_flush)(fd);
+}
+
 /* Reset the drive */
 void fd_reset(FDRV_PTR fd)
 {
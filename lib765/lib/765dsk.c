@@ -61,6 +61,28 @@ fdc_byte fdd_drive_status(FLOPPY_DRIVE *fd)
 }
 
 
+/* Empty the track cache. Anything dirty must have been written back first */
+static void fdd_drop_tracks(DSK_FLOPPY_DRIVE *fdd)
+{
+	int n;
+
+	for (n = 0; n < FDD_TRACK_CACHE; n++)
+	{
+		DSK_TRACK *t = &fdd->fdd_tracks[n];
+
+		if (t->dt_data) free(t->dt_data);
+		t->dt_data   = NULL;
+		t->dt_offset = -1;
+		t->dt_len    = 0;
+		t->dt_dirty  = 0;
+		t->dt_used   = 0;
+	}
+	fdd->fdd_track        = NULL;
+	fdd->fdd_track_header = NULL;
+	fdd->fdd_clock        = 0;
+}
+
+
 /* Reset variables: No DSK loaded. Called on eject and on initialisation */
 static void fdd_reset(FLOPPY_DRIVE *fd)
 {
@@ -69,7 +91,23 @@ static void fdd_reset(FLOPPY_DRIVE *fd)
         fdd->fdd_filename[0] = 0;
         fdd->fdd_fp = NULL;
         memset(fdd->fdd_disk_header,  0, sizeof(fdd->fdd_disk_header));
-        memset(fdd->fdd_track_header, 0, sizeof(fdd->fdd_track_header));
+	fdd_drop_tracks(fdd);
+}
+
+
+
+/* Rebuild the EXTENDED track offset table from track "from" onwards. Entry
+ * n is where track n starts, so entry n+1 less entry n is its length. */
+static void fdd_index_tracks(DSK_FLOPPY_DRIVE *fdd, int from)
+{
+	fdc_byte *b = fdd->fdd_disk_header + 0x34;
+	int nt;
+
+	if (from == 0) fdd->fdd_trkoff[0] = 256;	/* DSK header */
+	for (nt = from; nt < FDD_MAX_TRACKS; nt++)
+	{
+		fdd->fdd_trkoff[nt + 1] = fdd->fdd_trkoff[nt] + 256 * (1 + b[nt]);
+	}
 }
 
 
@@ -121,7 +159,8 @@ static int fdd_isready(FLOPPY_DRIVE *fd)
 		return 0;
 	} 
 /* File loaded OK. */
-	fdd->fdd_track_header[0] = 0;	/* Track header not loaded */
+	fdd_index_tracks(fdd, 0);
+	fdd_drop_tracks(fdd);		/* Track header not loaded */
 	
         return 1;
 }
@@ -132,12 +171,11 @@ static int fdd_isready(FLOPPY_DRIVE *fd)
  * is the same as cylinder number. For a double-sided disk, track number is
  * (2 * cylinder + head). This is independent of disc format.
  */
-static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
+static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head,
+			     int *trklen)
 {
-	fdc_byte *b;
 	int track;
 	long trk_offset;
-	int nt;
 	if (!fdd->fdd_fp) return -1;
 
 	/* Seek off the edge of the drive */
@@ -166,18 +204,17 @@ static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
 	
 	if (!memcmp(fdd->fdd_disk_header, "EXTENDED", 8))
 	{
-		trk_offset = 256;	/* DSK header = 256 bytes */
-		b = fdd->fdd_disk_header + 0x34;
-		for (nt = 0; nt < track; nt++)
-		{
-			trk_offset += 256 * (1 + b[nt]);
-		}
+		if (track >= FDD_MAX_TRACKS) return -1;
+		trk_offset = fdd->fdd_trkoff[track];
+		if (trklen) *trklen = fdd->fdd_trkoff[track + 1] - trk_offset;
 	}
 	else	/* Normal; all tracks have the same length */
 	{
 		trk_offset = (fdd->fdd_disk_header[0x33] * 256);
 		trk_offset += fdd->fdd_disk_header[0x32];
 
+		if (trklen) *trklen = trk_offset;
+
 		trk_offset *= track;		/* No. of tracks */
 		trk_offset += 256;		/* DSK header */	
 	}
@@ -185,17 +222,16 @@ static long fdd_lookup_track(DSK_FLOPPY_DRIVE *fdd, int cylinder, int head)
 }
 
 
+/* Find the ID entry for a sector in the current track. Where an ID appears
+ * more than once, this is the first. */
 static unsigned char *sector_head(DSK_FLOPPY_DRIVE *fdd, int sector)
 {
-        int ms = fdd->fdd_track_header[0x15];
-        int sec;
+	int n;
 
-        for (sec = 0; sec < ms; sec++)
-        {
-                if (fdd->fdd_track_header[0x1A + 8 * sec] == sector)
-                        return fdd->fdd_track_header + 0x18 + 8 * sec;
-        }
-        return NULL;
+	if (sector < 0 || sector > 255) return NULL;
+	n = fdd->fdd_track->dt_index[sector];
+	if (!n) return NULL;
+	return fdd->fdd_track_header + 0x18 + 8 * (n - 1);
 }
 
 
@@ -220,7 +256,7 @@ static fd_err_t fdd_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
 	fdc_dprintf(6, "fdd_seek_cylinder: DSK file open OK\n");
 
 	/* Check if the DSK image goes out to the correct cylinder */
-	nr = fdd_lookup_track(fdd, cylinder, 0);
+	nr = fdd_lookup_track(fdd, cylinder, 0, NULL);
 	
 	if (nr < 0) return FD_E_SEEKFAIL;
 
@@ -230,20 +266,153 @@ static fd_err_t fdd_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
 	return 0;
 }
 
-/* Load the "Track-Info" header for the current cylinder and given head */
+/* Write a cached track back to the DSK file */
+static fd_err_t fdd_write_track(DSK_FLOPPY_DRIVE *fdd, DSK_TRACK *t)
+{
+	if (!t->dt_dirty) return 0;
+
+	fseek(fdd->fdd_fp, t->dt_offset, SEEK_SET);
+	if (fwrite(t->dt_data, 1, t->dt_len, fdd->fdd_fp) < t->dt_len)
+	{
+		fdc_dprintf(0, "FDC: Could not write track at 0x%lx in %s\n",
+			t->dt_offset, fdd->fdd_filename);
+		return FD_E_READONLY;
+	}
+	t->dt_dirty = 0;
+	return 0;
+}
+
+
+/* Write back all dirty tracks. Any that can't be written stay dirty. */
+static fd_err_t fdd_write_tracks(DSK_FLOPPY_DRIVE *fdd)
+{
+	int n, wrote = 0;
+	fd_err_t err = 0;
+
+	for (n = 0; n < FDD_TRACK_CACHE; n++)
+	{
+		if (!fdd->fdd_tracks[n].dt_dirty) continue;
+		if (fdd_write_track(fdd, &fdd->fdd_tracks[n]))
+			err = FD_E_READONLY;
+		else	wrote = 1;
+	}
+	if (wrote && fflush(fdd->fdd_fp))
+	{
+		fdc_dprintf(0, "FDC: Could not write to %s\n", fdd->fdd_filename);
+		err = FD_E_READONLY;
+	}
+	return err;
+}
+
+
+/* fd_flush(): write back all dirty tracks, and say if any could not be */
+static void fdd_flush(FLOPPY_DRIVE *fd)
+{
+	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
+
+	if (!fdd->fdd_fp) return;
+	if (fdd_write_tracks(fdd))
+		fdc_dprintf(0, "FDC: Changes to %s have not all been saved\n",
+			fdd->fdd_filename);
+}
+
+
+/* Index the sector IDs of a newly loaded track, so that finding a sector 
+ * does not mean scanning the Track-Info block */
+static void fdd_index_sectors(DSK_FLOPPY_DRIVE *fdd, DSK_TRACK *t)
+{
+	fdc_byte *secid = t->dt_data + 0x18;
+	int maxsec = t->dt_data[0x15];
+	int ext = !memcmp(fdd->fdd_disk_header, "EXTENDED", 8);
+	int n, offset = 0;
+
+	memset(t->dt_index, 0, sizeof(t->dt_index));
+	if (maxsec > FDD_MAX_SECTORS) maxsec = FDD_MAX_SECTORS;
+	for (n = 0; n < maxsec; n++)
+	{
+		/* Extended DSKs have individual sector sizes */
+		if (ext) t->dt_seclen[n] = secid[6] + 256 * secid[7];
+		else	 t->dt_seclen[n] = (0x80 << t->dt_data[0x14]);
+		t->dt_secoff[n] = offset;
+		if (!t->dt_index[secid[2]]) t->dt_index[secid[2]] = n + 1;
+		offset += t->dt_seclen[n];
+		secid  += 8;
+	}
+}
+
+
+/* Load the current cylinder and given head into the track cache, making
+ * it the current track. The whole track (Track-Info header and all the
+ * sector data) is read in one go; the least recently used track is thrown
+ * out to make room, being written back first if it has been changed. */
 static fd_err_t fdd_load_track_header(DSK_FLOPPY_DRIVE *fdd, int head)
 {
-        long track = fdd_lookup_track(fdd, fdd->fdd.fd_cylinder, head);
+	DSK_TRACK *t, *victim;
+	fdc_byte *data;
+	int n, trklen, failed = 0;
+        long track = fdd_lookup_track(fdd, fdd->fdd.fd_cylinder, head, &trklen);
         if (track < 0) return FD_E_SEEKFAIL;       /* Bad track */
+
+	for (n = 0; n < FDD_TRACK_CACHE; n++)
+	{
+		t = &fdd->fdd_tracks[n];
+		if (t->dt_data && t->dt_offset == track)
+		{
+			t->dt_used = ++fdd->fdd_clock;
+			fdd->fdd_track = t;
+			fdd->fdd_track_header = t->dt_data;
+			return 0;
+		}
+	}
+	/* Throw out the least recently used track that is clean or can be 
+	 * written back. If none can, the changes are kept and the load fails. */
+	for (;;)
+	{
+		victim = NULL;
+		for (n = 0; n < FDD_TRACK_CACHE; n++)
+		{
+			t = &fdd->fdd_tracks[n];
+			if (failed & (1 << n)) continue;
+			if (!victim || t->dt_used < victim->dt_used) victim = t;
+		}
+		if (!victim) return FD_E_READONLY;
+		if (!fdd_write_track(fdd, victim)) break;
+		failed |= 1 << (victim - fdd->fdd_tracks);
+	}
+	t = victim;
+	fdd->fdd_track = NULL;
+	fdd->fdd_track_header = NULL;
+	t->dt_offset = -1;
+	t->dt_dirty  = 0;
+	t->dt_used   = 0;
+
+	if (trklen < 256) trklen = 256;
+	data = realloc(t->dt_data, trklen);
+	if (!data)
+	{
+		fdc_dprintf(0, "FDC: Out of memory caching track %d\n",
+			fdd->fdd.fd_cylinder);
+		return FD_E_NOADDR;
+	}
+	t->dt_data = data;
+
         fseek(fdd->fdd_fp, track, SEEK_SET);
-        if (fread(fdd->fdd_track_header, 1, 256, fdd->fdd_fp) < 256)
+	/* The last track may be cut short; whatever is missing reads as a
+	 * data error */
+	t->dt_len = fread(t->dt_data, 1, trklen, fdd->fdd_fp);
+        if (t->dt_len < 256)
                 return FD_E_NOADDR;              /* Missing address mark */
-        if (memcmp(fdd->fdd_track_header, "Track-Info", 10))
+        if (memcmp(t->dt_data, "Track-Info", 10))
         {
                 fdc_dprintf(0, "FDC: Did not find track %d header at 0x%lx in %s\n",
                         fdd->fdd.fd_cylinder, track, fdd->fdd_filename);
                 return FD_E_NOADDR;
         }
+	fdd_index_sectors(fdd, t);
+	t->dt_offset = track;
+	t->dt_used = ++fdd->fdd_clock;
+	fdd->fdd_track = t;
+	fdd->fdd_track_header = t->dt_data;
 	return 0;
 }
 
@@ -265,55 +434,40 @@ static fd_err_t fdd_read_id(FLOPPY_DRIVE *fd, int head, int sector, fdc_byte *bu
 }
 
 
-/* Find the offset of a sector in the current track 
- * Enter with fdd_track_header loaded and the file pointer 
- * just after it (ie, you have just called fdd_load_track_header() ) */
+/* Find the offset of a sector in the current track, from the end of the
+ * Track-Info header.
+ * Enter with fdd_track_header loaded (ie, you have just called 
+ * fdd_load_track_header() ) */
 
 static long fdd_sector_offset(DSK_FLOPPY_DRIVE *fdd, int sector, int *seclen,
 			      fdc_byte **secid)
 {
-	int maxsec = fdd->fdd_track_header[0x15];
-	long offset = 0;
+	DSK_TRACK *t = fdd->fdd_track;
 	int n;
 
+	if (sector < 0 || sector > 255) return -1;
+	n = t->dt_index[sector];
+	if (!n) return -1;	/* Sector not found */
+	--n;
+
 	/* Pointer to sector details */
-	*secid = fdd->fdd_track_header + 0x18;
+	*secid = fdd->fdd_track_header + 0x18 + 8 * n;
 
 	/* Length of sector */	
-	*seclen = (0x80 << fdd->fdd_track_header[0x14]);
-
-	/* Extended DSKs have individual sector sizes */
-	if (!memcmp(fdd->fdd_disk_header, "EXTENDED", 8))
-	{
-		for (n = 0; n < maxsec; n++)
-		{
-			*seclen = (*secid)[7] + 256 * (*secid)[8];
-                       if ((*secid)[2] == sector) return offset;
-			offset   += (*seclen);
-			(*secid) += 8;
-		}
-	}
-	else	/* Non-extended, all sector sizes are the same */
-	{
-		for (n = 0; n < maxsec; n++)
-		{
-			if ((*secid)[2] == sector) return offset;
-			offset   += (*seclen);
-			(*secid) += 8;
-		}
-	}
-	return -1;	/* Sector not found */
+	*seclen = t->dt_seclen[n];
+	return t->dt_secoff[n];
 }
 
 
 
-/* Seek within the DSK file to a given head & sector in the current cylinder.
+/* Find a given head & sector in the current cylinder, and return a pointer
+ * to its data in the track cache.
  * Then check that "xhead" and "xcylinder" match the sector's ID fields */
 static fd_err_t fdd_seekto_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
-		int head, int sector, fdc_byte *buf, int *len)
+		int head, int sector, fdc_byte **data, int *len)
 {
         DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
-        int n, offs, seclen;
+        int n, offs, seclen, avail;
 	fd_err_t err = FD_E_OK;
 	fdc_byte *secid;
 
@@ -338,8 +492,15 @@ static fd_err_t fdd_seekto_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 		err = FD_E_DATAERR;
 		seclen = *len;
 	}	
-	offs += ftell(fdd->fdd_fp);	
-	fseek(fdd->fdd_fp, offs, SEEK_SET);				
+	/* Don't run off the end of a short track */
+	avail = fdd->fdd_track->dt_len - 256 - offs;
+	if (avail < 0) avail = 0;
+	if (*len > avail)
+	{
+		err = FD_E_DATAERR;
+		*len = avail;
+	}
+	*data = fdd->fdd_track_header + 256 + offs;
 	return err;			
 }
 
@@ -353,6 +514,7 @@ static fd_err_t fdd_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
         int try_again = 0;
         DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
 	unsigned char *sh;
+	fdc_byte *data;
 	fd_err_t err;
 
 	fdc_dprintf(4, "fdd_read_sector: Expected cyl=%d head=%d sector=%d\n",
@@ -362,7 +524,7 @@ static fd_err_t fdd_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 	do
 	{
 		err  = fdd_seekto_sector(fd,xcylinder,xhead,head,
-							sector,buf,&len);
+							sector,&data,&len);
 /* Are we retrying because we are looking for deleted data and found 
  * nondeleted or vice versa?
  *
@@ -391,8 +553,7 @@ static fd_err_t fdd_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
                         }
 			else *deleted = 1;
                 }
-		if (fread(buf, 1, len, ((DSK_FLOPPY_DRIVE *)fd)->fdd_fp) < len) 
-			err = FD_E_DATAERR;
+		memcpy(buf, data, len);
 	} while (try_again);
 	return err;
 }		
@@ -437,12 +598,12 @@ static fd_err_t fdd_read_track(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
                 err = FD_E_DATAERR;
 		trklen = (*len);	
 	}
-
-        if (err == FD_E_DATAERR || err == FD_E_OK)
-        {
-                if (fread(buf, 1, trklen, fdd->fdd_fp) < (*len))
-			err = FD_E_DATAERR;
-        }
+	/* Only what is actually in the image can be read */
+	if (trklen > fdd->fdd_track->dt_len - 256)
+		trklen = fdd->fdd_track->dt_len - 256;
+	memcpy(buf, fdd->fdd_track_header + 256, trklen);
+	if (trklen < (*len))
+		err = FD_E_DATAERR;
         return err;
 }
 
@@ -455,35 +616,29 @@ static fd_err_t fdd_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
 {
 	fd_err_t err;
 	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
+	fdc_byte *data;
 
         fdc_dprintf(4, "fdd_write_sector: Expected cyl=%d head=%d sector=%d\n",
                         xcylinder, xhead, sector);
 
-	err = fdd_seekto_sector(fd,xcylinder,xhead,head,sector,buf,
+	err = fdd_seekto_sector(fd,xcylinder,xhead,head,sector,&data,
 						&len);
 
 	if (fd->fd_readonly) return FD_E_READONLY;
 	if (err == FD_E_DATAERR || err == 0)
 	{
-                unsigned char odel, *sh = sector_head(fdd, sector);
-		if (fwrite(buf, 1, len, fdd->fdd_fp) < len)
-			err = FD_E_READONLY;
+                unsigned char *sh = sector_head(fdd, sector);
+
+/* The write goes into the track cache, and reaches the file when the track
+ * is flushed or thrown out of the cache */
+		memcpy(data, buf, len);
+		fdd->fdd_track->dt_dirty = 1;
 		fdd->fdd_dirty = 1;
 
 /* If writing deleted data, update the sector header accordingly */
-                odel = sh[5];
                 if (deleted) sh[5] |= 0x40;
                 else         sh[5] &= ~0x40;
 
-                if (sh[5] != odel)
-                {
-                        long track = fdd_lookup_track(fdd, fd->fd_cylinder, head);
-                        if (track < 0) return FD_E_SEEKFAIL;       /* Bad track */
-                        fseek(fdd->fdd_fp, track, SEEK_SET);
-                        if (fwrite(fdd->fdd_track_header, 1, 256, fdd->fdd_fp) < 256)
-                                return FD_E_DATAERR; 
-                }
-
 	}
 	return err;
 }
@@ -496,6 +651,7 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 	DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
 	int n, img_trklen, trklen, trkoff, trkno, ext, seclen;
 	fdc_byte oldhead[256];     
+	fdc_byte trkhead[256];
 
         fdc_dprintf(4, "fdd_format_track: head=%d sectors=%d\n",
                         head, sectors); 
@@ -503,6 +659,10 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
  
 	if (!fdd->fdd_fp) return FD_E_NOTRDY;
 	if (fd->fd_readonly) return FD_E_READONLY;
+	/* Formatting can move tracks around in the file, so write the cache 
+	 * back and start afresh */
+	if (fdd_write_tracks(fdd)) return FD_E_READONLY;
+	fdd_drop_tracks(fdd);
 	ext = 0;
 	memcpy(oldhead, fdd->fdd_disk_header, 256);
 	
@@ -552,6 +712,11 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 		 * others */
 
 		ext = 1;
+		if (trkno >= FDD_MAX_TRACKS) 	/* No room in the header */
+		{
+			memcpy(fdd->fdd_disk_header, oldhead, 256);
+			return FD_E_READONLY;
+		}
 		img_trklen = (fdd->fdd_disk_header[0x34 + trkno] * 256) + 256;
 		if (img_trklen)
 		{
@@ -567,13 +732,14 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 		}
 		/* Work out where the track should be. */
                 b = fdd->fdd_disk_header + 0x34;
-       		trkoff = 256; 
-	        for (n = 0; n < trkno; n++)
-                {
-                        trkoff += 256 * (1 + b[n]);
-                }
-		/* Store the length of the new track */
-		if (!b[n]) b[n] = (trklen >> 8) - 1;
+		trkoff = fdd->fdd_trkoff[trkno];
+		/* Store the length of the new track. Only the tracks after 
+		 * this one move. */
+		if (!b[trkno]) 
+		{
+			b[trkno] = (trklen >> 8) - 1;
+			fdd_index_tracks(fdd, trkno);
+		}
 	}
 	else
 	{
@@ -606,32 +772,33 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
  * 40 tracks that will grow to 80 tracks */
 	fseek(fdd->fdd_fp, trkoff, SEEK_SET);
 	/* Now generate and write a Track-Info buffer */
-	memset(fdd->fdd_track_header, 0, sizeof(fdd->fdd_track_header));
+	memset(trkhead, 0, sizeof(trkhead));
 
-	strcpy((char *)fdd->fdd_track_header, "Track-Info\r\n");	
+	strcpy((char *)trkhead, "Track-Info\r\n");	
 	
-	fdd->fdd_track_header[0x10] = fd->fd_cylinder;
-	fdd->fdd_track_header[0x11] = head;
-	fdd->fdd_track_header[0x14] = track[3];
-	fdd->fdd_track_header[0x15] = sectors;
-	fdd->fdd_track_header[0x16] = track[2];
-	fdd->fdd_track_header[0x17] = filler;
+	trkhead[0x10] = fd->fd_cylinder;
+	trkhead[0x11] = head;
+	trkhead[0x14] = track[3];
+	trkhead[0x15] = sectors;
+	trkhead[0x16] = track[2];
+	trkhead[0x17] = filler;
 	for (n = 0; n < sectors; n++)
 	{
-		fdd->fdd_track_header[0x18 + 8*n] = track[4*n];
-		fdd->fdd_track_header[0x19 + 8*n] = track[4*n+1];
-		fdd->fdd_track_header[0x1A + 8*n] = track[4*n+2];
-		fdd->fdd_track_header[0x1B + 8*n] = track[4*n+3];
+		trkhead[0x18 + 8*n] = track[4*n];
+		trkhead[0x19 + 8*n] = track[4*n+1];
+		trkhead[0x1A + 8*n] = track[4*n+2];
+		trkhead[0x1B + 8*n] = track[4*n+3];
 		if (ext)
 		{
 			seclen = 128 << track[4 * n + 3];
-			fdd->fdd_track_header[0x1E + 8 * n] = seclen & 0xFF;
-			fdd->fdd_track_header[0x1F + 8 * n] = seclen >> 8;
+			trkhead[0x1E + 8 * n] = seclen & 0xFF;
+			trkhead[0x1F + 8 * n] = seclen >> 8;
 		}
 	}
-	if (fwrite(fdd->fdd_track_header, 1, 256, fdd->fdd_fp) < 256)
+	if (fwrite(trkhead, 1, 256, fdd->fdd_fp) < 256)
 	{
 		memcpy(fdd->fdd_disk_header, oldhead, 256);
+		fdd_index_tracks(fdd, trkno);
 		return FD_E_READONLY;
 	}
 	fdd->fdd_dirty = 1;
@@ -646,6 +813,7 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 			if (fputc(filler, fdd->fdd_fp) == EOF) 
 			{
 				memcpy(fdd->fdd_disk_header, oldhead, 256);
+				fdd_index_tracks(fdd, trkno);
 				return FD_E_READONLY;
 			}
 		}
@@ -659,6 +827,7 @@ static fd_err_t fdd_format_track(FLOPPY_DRIVE *fd, int head,
 	if (fwrite(fdd->fdd_disk_header, 1, 256, fdd->fdd_fp) < 256)
 	{
 		memcpy(fdd->fdd_disk_header, oldhead, 256);
+		fdd_index_tracks(fdd, trkno);
 		return FD_E_READONLY;
 	}
 	return FD_E_OK;
@@ -676,8 +845,11 @@ static void fdd_eject(FLOPPY_DRIVE *fd)
 {
         DSK_FLOPPY_DRIVE *fdd = (DSK_FLOPPY_DRIVE *)fd;
 
-	if (fdd->fdd_fp) fclose(fdd->fdd_fp);
-
+	if (fdd->fdd_fp) 
+	{
+		fdd_flush(fd);
+		fclose(fdd->fdd_fp);
+	}
 	fdd_reset(fd);
 }
 
@@ -695,7 +867,10 @@ static FLOPPY_DRIVE_VTABLE fdv_dsk =
 	fdd_dirty,
 	fdd_eject,
 	NULL,
-	fdd_reset
+	fdd_reset,
+	fdd_eject,	/* Destroy: write back and free the track cache */
+	NULL,
+	fdd_flush
 };
 
 /* Initialise a DSK-based drive */
@@ -704,6 +879,9 @@ FDRV_PTR fd_newdsk(void)
 	FDRV_PTR p = fd_inew(sizeof(DSK_FLOPPY_DRIVE));
 
 	p->fd_vtable = &fdv_dsk;
+	/* fd_inew() doesn't clear the subclass fields */
+	memset(((DSK_FLOPPY_DRIVE *)p)->fdd_tracks, 0, 
+		sizeof(((DSK_FLOPPY_DRIVE *)p)->fdd_tracks));
 	fd_reset(p);
 	return p;
 }
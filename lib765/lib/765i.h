@@ -53,6 +53,7 @@ typedef struct floppy_drive_vtable
 	void     (*fdv_reset  )(FDRV_PTR fd);
 	void     (*fdv_destroy)(FDRV_PTR fd);
 	int	 (*fdv_changed)(FDRV_PTR fd);
+	void     (*fdv_flush  )(FDRV_PTR fd);
 } FLOPPY_DRIVE_VTABLE;
 
 
@@ -85,6 +86,26 @@ typedef struct floppy_drive
                            * of a 40-track DSK file. */
 } FLOPPY_DRIVE;
 
+/* A whole track of a .DSK file (Track-Info block and sector data) held in
+ * memory */
+#define FDD_TRACK_CACHE	8		/* Tracks cached per drive */
+#define FDD_MAX_TRACKS	204		/* Size of the EXTENDED track table */
+#define FDD_MAX_SECTORS	29		/* Sector IDs in a Track-Info block */
+
+typedef struct dsk_track
+{
+	long      dt_offset;		/* Offset in the file, -1 if unused */
+	int       dt_len;		/* Length including Track-Info */
+	int       dt_dirty;		/* Needs writing back */
+	unsigned  dt_used;		/* For LRU replacement */
+	fdc_byte *dt_data;
+	fdc_byte  dt_index[256];	/* Sector ID -> ID entry + 1, 0 if
+					 * there is no such sector */
+	int       dt_secoff[FDD_MAX_SECTORS];	/* Data offset of each 
+						 * sector, after Track-Info */
+	int       dt_seclen[FDD_MAX_SECTORS];	/* Data length of each sector */
+} DSK_TRACK;
+
 /* Subclass of FLOPPY_DRIVE: a drive which emulates discs using the CPCEMU 
  * .DSK format */
 
@@ -98,10 +119,62 @@ typedef struct dsk_floppy_drive
 /* PRIVATE variables: */
 	FILE *fdd_fp;			/* File of the .DSK file */
 	fdc_byte fdd_disk_header[256];	/* .DSK header */
-	fdc_byte fdd_track_header[256];	/* .DSK track header */
+	long fdd_trkoff[FDD_MAX_TRACKS + 1];	/* EXTENDED .DSK: where each
+					 * track starts in the file */
+	fdc_byte *fdd_track_header;	/* .DSK track header of the current
+					 * track, in the track cache */
 	int fdd_dirty;			/* Has this disk been written to? */
+	DSK_TRACK fdd_tracks[FDD_TRACK_CACHE];
+	DSK_TRACK *fdd_track;		/* Current track */
+	unsigned  fdd_clock;		/* LRU counter */
 } DSK_FLOPPY_DRIVE;
 
+/* Subclass of FLOPPY_DRIVE: a drive which emulates discs using a CPCEMU
+ * .DSK file mapped into memory */
+
+typedef struct mdsk_floppy_drive
+{
+/* PUBLIC variables: */
+	FLOPPY_DRIVE fdm;		/* Base class */
+	char fdm_filename[PATH_MAX];	/* Filename to .DSK file. Before 
+					 * changing this call fd_eject() on
+                                         * the drive */
+/* PRIVATE variables: */
+	int fdm_fd;			/* File descriptor, -1 if closed */
+	int fdm_rdonly;			/* File could only be opened (and
+					 * so mapped) read-only */
+	fdc_byte *fdm_map;		/* The mapped .DSK file, starting 
+					 * with its header */
+	long fdm_size;			/* Size of the file and mapping */
+	long fdm_trkoff[FDD_MAX_TRACKS + 1];	/* EXTENDED .DSK: where each
+					 * track starts in the file */
+	fdc_byte *fdm_track_header;	/* Track header of the current track,
+					 * in the mapping */
+	long fdm_track_len;		/* Bytes of the current track that
+					 * are in the file */
+	int fdm_dirty;			/* Has this disk been written to? */
+} MDSK_FLOPPY_DRIVE;
+
+/* Subclass of FLOPPY_DRIVE: a drive which emulates discs using raw images
+ * of the sector data */
+
+typedef struct raw_floppy_drive
+{
+/* PUBLIC variables: */
+	FLOPPY_DRIVE fdr;		/* Base class */
+	char fdr_filename[PATH_MAX];	/* Filename of the image. Before 
+					 * changing this call fd_eject() on
+                                         * the drive */
+	FD_GEOMETRY fdr_geom;		/* Layout of the image */
+/* PRIVATE variables: */
+	int fdr_fd;			/* File descriptor, -1 if closed */
+	int fdr_rdonly;			/* File could only be opened (and
+					 * so mapped) read-only */
+	fdc_byte *fdr_map;		/* The mapped image */
+	long fdr_size;			/* Size of the file and mapping */
+	int fdr_dirty;			/* Has this disk been written to? */
+} RAW_FLOPPY_DRIVE;
+
 #ifdef DSK_ERR_OK	/* LIBDSK headers included */
 typedef struct libdsk_floppy_drive
 {
@@ -0,0 +1,682 @@
+/* 765: Library to emulate the uPD765a floppy controller (aka Intel 8272)
+
+    Copyright (C) 2000  John Elliott <jce@seasip.demon.co.uk>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* A drive which emulates discs using CPCEMU .DSK files, like the one in
+ * 765dsk.c, but with the whole file mapped into memory. Sector reads and
+ * writes are then just copies to and from the mapping, and the kernel
+ * looks after getting changes back to the file. */
+
+#include "765i.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern fdc_byte fdd_drive_status(FLOPPY_DRIVE *fd);
+
+
+/* Reset variables: No DSK loaded. Called on eject and on initialisation */
+static void fdm_reset(FLOPPY_DRIVE *fd)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+	fdm->fdm_filename[0]  = 0;
+	fdm->fdm_fd           = -1;
+	fdm->fdm_rdonly       = 0;
+	fdm->fdm_map          = NULL;
+	fdm->fdm_size         = 0;
+	fdm->fdm_track_header = NULL;
+	fdm->fdm_track_len    = 0;
+}
+
+
+/* Unmap and close the DSK file */
+static void fdm_close(MDSK_FLOPPY_DRIVE *fdm)
+{
+	if (fdm->fdm_map) munmap(fdm->fdm_map, fdm->fdm_size);
+	if (fdm->fdm_fd >= 0) close(fdm->fdm_fd);
+	fdm->fdm_map = NULL;
+	fdm->fdm_fd  = -1;
+}
+
+
+/* Map "size" bytes of the open DSK file */
+static int fdm_map_file(MDSK_FLOPPY_DRIVE *fdm, long size)
+{
+	void *p;
+	int prot = PROT_READ;
+
+	if (!fdm->fdm_rdonly) prot |= PROT_WRITE;
+	p = mmap(NULL, size, prot, MAP_SHARED, fdm->fdm_fd, 0);
+	if (p == MAP_FAILED)
+	{
+		fdc_dprintf(0, "Could not map %s.\n", fdm->fdm_filename);
+		fdm->fdm_map = NULL;
+		return -1;
+	}
+	fdm->fdm_map  = p;
+	fdm->fdm_size = size;
+	return 0;
+}
+
+
+/* Make the DSK file at least "size" bytes long, and map it again */
+static int fdm_grow(MDSK_FLOPPY_DRIVE *fdm, long size)
+{
+	long oldsize = fdm->fdm_size;
+
+	fdm->fdm_track_header = NULL;	/* Mapping is about to move */
+	munmap(fdm->fdm_map, fdm->fdm_size);
+	fdm->fdm_map = NULL;
+	if (ftruncate(fdm->fdm_fd, size) == 0 && !fdm_map_file(fdm, size))
+		return 0;
+
+	fdc_dprintf(0, "Could not extend %s.\n", fdm->fdm_filename);
+	if (fdm_map_file(fdm, oldsize))
+	{
+		fdm_close(fdm);
+		fdm_reset(&fdm->fdm);
+	}
+	return -1;
+}
+
+
+/* Rebuild the EXTENDED track offset table from track "from" onwards */
+static void fdm_index_tracks(MDSK_FLOPPY_DRIVE *fdm, int from)
+{
+	fdc_byte *b = fdm->fdm_map + 0x34;
+	int nt;
+
+	if (from == 0) fdm->fdm_trkoff[0] = 256;	/* DSK header */
+	for (nt = from; nt < FDD_MAX_TRACKS; nt++)
+	{
+		fdm->fdm_trkoff[nt + 1] = fdm->fdm_trkoff[nt] + 256 * (1 + b[nt]);
+	}
+}
+
+
+/* Return 1 if this drive is ready, else 0
+ * Attempts to open and map the DSK, and must therefore be called before
+ * any attempted DSK file access. */
+static int fdm_isready(FLOPPY_DRIVE *fd)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	struct stat st;
+
+	if (!fd->fd_motor) return 0;	/* Motor is not running */
+
+	if (fdm->fdm_map) return 1;		 /* DSK file is mapped and OK */
+	if (fdm->fdm_filename[0] == 0) return 0; /* No filename */
+
+	fdm->fdm_fd = open(fdm->fdm_filename, O_RDWR);
+	if (fdm->fdm_fd < 0)
+	{
+		fdm->fdm_fd = open(fdm->fdm_filename, O_RDONLY);
+		if (fdm->fdm_fd >= 0)
+		{
+			fd->fd_readonly = 1;	/* Read-only drive */
+			fdm->fdm_rdonly = 1;
+			fdc_dprintf(0, "Could only open %s read-only.\n",
+					fdm->fdm_filename);
+		}
+		else fdc_dprintf(0, "Could not open %s.\n", fdm->fdm_filename);
+	}
+	if (fdm->fdm_fd < 0)
+	{
+		fdm_reset(fd);
+		return 0;
+	}
+/* File has been newly opened. Map it and check its header */
+	if (fstat(fdm->fdm_fd, &st) || st.st_size < 256)
+	{
+		fdc_dprintf(0, "Could not load DSK file header: %s\n",
+				fdm->fdm_filename);
+		fdm_close(fdm);
+		fdm_reset(fd);
+		return 0;
+	}
+	if (fdm_map_file(fdm, st.st_size))
+	{
+		fdm_close(fdm);
+		fdm_reset(fd);
+		return 0;
+	}
+	if (memcmp("MV - CPC", fdm->fdm_map, 8) &&
+	    memcmp("EXTENDED", fdm->fdm_map, 8))
+	{
+		fdc_dprintf(0, "File %s is not in DSK or extended DSK format\n",
+				fdm->fdm_filename);
+		fdm_close(fdm);
+		fdm_reset(fd);
+		return 0;
+	}
+/* File mapped OK. */
+	fdm_index_tracks(fdm, 0);
+	fdm->fdm_track_header = NULL;	/* Track header not loaded */
+	return 1;
+}
+
+
+/* Find the offset in a DSK for a particular cylinder/head. See
+ * fdd_lookup_track() for the details. */
+static long fdm_lookup_track(MDSK_FLOPPY_DRIVE *fdm, int cylinder, int head,
+			     int *trklen)
+{
+	fdc_byte *hdr = fdm->fdm_map;
+	int track;
+	long trk_offset;
+
+	if (!hdr) return -1;
+
+	/* Seek off the edge of the drive */
+	if (cylinder >  fdm->fdm.fd_cylinders) return -1;
+	if (head     >= fdm->fdm.fd_heads)     return -1;
+
+	/* Double-stepping */
+	if ((fdm->fdm.fd_type == FD_30 || fdm->fdm.fd_type == FD_525) &&
+	    hdr[0x30] > 43 && fdm->fdm.fd_cylinders >= 80)
+	{
+		cylinder /= 2;
+	}
+
+	/* Convert cylinder & head to CPCEMU "track" */
+	track = cylinder;
+	if (hdr[0x31] > 1) track *= 2;
+	track += head;
+
+	if (!memcmp(hdr, "EXTENDED", 8))
+	{
+		if (track >= FDD_MAX_TRACKS) return -1;
+		trk_offset = fdm->fdm_trkoff[track];
+		if (trklen) *trklen = fdm->fdm_trkoff[track + 1] - trk_offset;
+	}
+	else	/* Normal; all tracks have the same length */
+	{
+		trk_offset = hdr[0x32] + 256 * hdr[0x33];
+		if (trklen) *trklen = trk_offset;
+
+		trk_offset *= track;		/* No. of tracks */
+		trk_offset += 256;		/* DSK header */
+	}
+	return trk_offset;
+}
+
+
+/* Seek to a cylinder. Checks if that particular cylinder exists. */
+static fd_err_t fdm_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+	fdc_dprintf(4, "fdm_seek_cylinder: cylinder=%d\n",cylinder);
+
+	if (!fdm->fdm_map) return FD_E_NOTRDY;
+
+	if (fdm_lookup_track(fdm, cylinder, 0, NULL) < 0)
+		return FD_E_SEEKFAIL;
+
+	fd->fd_cylinder = cylinder;
+	return 0;
+}
+
+
+/* Find the "Track-Info" header for the current cylinder and given head */
+static fd_err_t fdm_load_track_header(MDSK_FLOPPY_DRIVE *fdm, int head)
+{
+	int trklen;
+	long track = fdm_lookup_track(fdm, fdm->fdm.fd_cylinder, head, &trklen);
+
+	fdm->fdm_track_header = NULL;
+	if (track < 0) return FD_E_SEEKFAIL;       /* Bad track */
+	if (track + 256 > fdm->fdm_size)
+		return FD_E_NOADDR;              /* Missing address mark */
+	if (memcmp(fdm->fdm_map + track, "Track-Info", 10))
+	{
+		fdc_dprintf(0, "FDC: Did not find track %d header at 0x%lx in %s\n",
+			fdm->fdm.fd_cylinder, track, fdm->fdm_filename);
+		return FD_E_NOADDR;
+	}
+	fdm->fdm_track_header = fdm->fdm_map + track;
+	/* The last track may be cut short */
+	fdm->fdm_track_len = trklen;
+	if (track + trklen > fdm->fdm_size)
+		fdm->fdm_track_len = fdm->fdm_size - track;
+	return 0;
+}
+
+
+/* Find a sector in the current track. Returns its ID entry, and its data
+ * offset (from the end of the Track-Info header) and length */
+static fdc_byte *fdm_find_sector(MDSK_FLOPPY_DRIVE *fdm, int sector,
+				 long *offset, int *seclen)
+{
+	fdc_byte *secid = fdm->fdm_track_header + 0x18;
+	int maxsec = fdm->fdm_track_header[0x15];
+	int ext = !memcmp(fdm->fdm_map, "EXTENDED", 8);
+	int n;
+
+	if (maxsec > FDD_MAX_SECTORS) maxsec = FDD_MAX_SECTORS;
+	*offset = 0;
+	for (n = 0; n < maxsec; n++)
+	{
+		/* Extended DSKs have individual sector sizes */
+		if (ext) *seclen = secid[6] + 256 * secid[7];
+		else	 *seclen = (0x80 << fdm->fdm_track_header[0x14]);
+		if (secid[2] == sector) return secid;
+		*offset += *seclen;
+		secid   += 8;
+	}
+	return NULL;	/* Sector not found */
+}
+
+
+/* Read a sector ID from the current track */
+static fd_err_t fdm_read_id(FLOPPY_DRIVE *fd, int head, int sector, fdc_byte *buf)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	int n, offs;
+
+	n = fdm_load_track_header(fdm, head);
+	if (n < 0) return n;
+
+	/* Offset of the chosen sector header */
+	offs = 0x18 + 8 * (sector % fdm->fdm_track_header[0x15]);
+
+	for (n = 0; n < 4; n++) buf[n] = fdm->fdm_track_header[offs+n];
+	return 0;
+}
+
+
+/* Find a given head & sector in the current cylinder, and return a pointer
+ * to its data in the mapping and its ID entry.
+ * Then check that "xhead" and "xcylinder" match the sector's ID fields */
+static fd_err_t fdm_seekto_sector(MDSK_FLOPPY_DRIVE *fdm, int xcylinder,
+		int xhead, int head, int sector, fdc_byte **data,
+		fdc_byte **secid, int *len)
+{
+	int n, seclen;
+	long offs, avail;
+	fd_err_t err = FD_E_OK;
+
+	n = fdm_load_track_header(fdm, head);
+	if (n < 0) return n;
+	*secid = fdm_find_sector(fdm, sector, &offs, &seclen);
+	if (!*secid) return FD_E_NOSECTOR;	/* Sector not found */
+
+	if (xcylinder != (*secid)[0] || xhead != (*secid)[1])
+	{
+		fdc_dprintf(0, "FDC: Looking for cyl=%d head=%d but found "
+		    "cyl=%d head=%d\n", xcylinder, xhead,
+		    (*secid)[0], (*secid)[1]);
+		return FD_E_NOSECTOR;
+	}
+	if (seclen != *len)
+	{
+		err = FD_E_DATAERR;
+		if (seclen < *len) *len = seclen;
+	}
+	/* Don't run off the end of a short track */
+	avail = fdm->fdm_track_len - 256 - offs;
+	if (avail < 0) avail = 0;
+	if (*len > avail)
+	{
+		err = FD_E_DATAERR;
+		*len = avail;
+	}
+	*data = fdm->fdm_track_header + 256 + offs;
+	return err;
+}
+
+
+/* Read a sector */
+static fd_err_t fdm_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+		int head,  int sector, fdc_byte *buf, int len,
+		int *deleted, int skip_deleted, int mfm, int multi)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	int rdeleted = 0;
+	int try_again = 0;
+	fdc_byte *data, *sh;
+	fd_err_t err;
+
+	fdc_dprintf(4, "fdm_read_sector: Expected cyl=%d head=%d sector=%d\n",
+			xcylinder, xhead, sector);
+	if (deleted && *deleted) rdeleted = 0x40;
+
+	do
+	{
+		err = fdm_seekto_sector(fdm, xcylinder, xhead, head, sector,
+					&data, &sh, &len);
+/* As for fdd_read_sector(), skipping deleted data does not go on to the
+ * rest of the cylinder */
+		if (try_again == 1 && err == FD_E_NOADDR)
+		{
+			err = FD_E_NODATA;
+		}
+		try_again = 0;
+		if (err != FD_E_DATAERR && err != FD_E_OK) return err;
+/* Check if the sector contains deleted data rather than nondeleted */
+		*deleted = 0;
+		if (rdeleted != (sh[5] & 0x40)) /* Mismatch! */
+		{
+			if (skip_deleted)
+			{
+/* Try the next sector. */
+				try_again = 1;
+				++sector;
+				continue;
+			}
+			else *deleted = 1;
+		}
+		memcpy(buf, data, len);
+	} while (try_again);
+	return err;
+}
+
+
+/* Read a track */
+static fd_err_t fdm_read_track(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+		int head,  fdc_byte *buf, int *len)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	int n, trklen;
+	fd_err_t err = FD_E_OK;
+
+	fdc_dprintf(4, "fdm_read_track: Expected cyl=%d head=%d\n",
+			xcylinder, xhead);
+
+	n = fdm_load_track_header(fdm, head);
+	if (n < 0) return n;
+
+	if (xcylinder != fdm->fdm_track_header[0x18] ||
+	    xhead     != fdm->fdm_track_header[0x19])
+	{
+		fdc_dprintf(0, "FDC: Looking for cyl=%d head=%d but found "
+		    "cyl=%d head=%d\n", xcylinder, xhead,
+		    fdm->fdm_track_header[0x18], fdm->fdm_track_header[0x19]);
+		return FD_E_NOSECTOR;
+	}
+	trklen = fdm->fdm_track_len - 256;
+	if (trklen > *len)
+	{
+		err = FD_E_DATAERR;
+		trklen = (*len);
+	}
+	memcpy(buf, fdm->fdm_track_header + 256, trklen);
+	if (trklen < (*len))
+		err = FD_E_DATAERR;
+	return err;
+}
+
+
+/* Write a sector */
+static fd_err_t fdm_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+			int head, int sector, fdc_byte *buf, int len,
+			int deleted, int skip_deleted, int mfm, int multi)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	fdc_byte *data, *sh;
+	fd_err_t err;
+
+	fdc_dprintf(4, "fdm_write_sector: Expected cyl=%d head=%d sector=%d\n",
+			xcylinder, xhead, sector);
+
+	err = fdm_seekto_sector(fdm, xcylinder, xhead, head, sector,
+				&data, &sh, &len);
+
+	if (fd->fd_readonly || fdm->fdm_rdonly) return FD_E_READONLY;
+	if (err == FD_E_DATAERR || err == 0)
+	{
+		memcpy(data, buf, len);
+		fdm->fdm_dirty = 1;
+
+/* If writing deleted data, update the sector header accordingly */
+		if (deleted) sh[5] |= 0x40;
+		else         sh[5] &= ~0x40;
+	}
+	return err;
+}
+
+
+/* Format a track on a DSK. This follows fdd_format_track(); if the track
+ * runs past the end of the file, the file is extended and mapped again. */
+static fd_err_t fdm_format_track(FLOPPY_DRIVE *fd, int head,
+		int sectors, fdc_byte *track, fdc_byte filler)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+	int n, img_trklen, trklen, trkno, ext, seclen;
+	long trkoff;
+	fdc_byte oldhead[256];
+	fdc_byte *hdr, *trkhead;
+
+	fdc_dprintf(4, "fdm_format_track: head=%d sectors=%d\n",
+			head, sectors);
+
+	if (!fdm->fdm_map) return FD_E_NOTRDY;
+	if (fd->fd_readonly || fdm->fdm_rdonly) return FD_E_READONLY;
+	if (sectors > FDD_MAX_SECTORS) return FD_E_READONLY;
+	hdr = fdm->fdm_map;
+	ext = 0;
+	memcpy(oldhead, hdr, 256);
+	fdm->fdm_track_header = NULL;
+
+/* 1. Only if the DSK has either (1 track & 1 head) or (2 heads) can we
+ *   format the second head
+ */
+	if (head)
+	{
+		if (hdr[0x31] == 1 && hdr[0x30] > 1) return FD_E_READONLY;
+		if (hdr[0x31] == 1) hdr[0x31] = 2;
+	}
+/* 2. Find out the CPCEMU number of the new cylinder/head */
+	if (hdr[0x31] < 1) hdr[0x31] = 1;
+	trkno = fd->fd_cylinder;
+	trkno *= hdr[0x31];
+	trkno += head;
+
+/* 3. Find out how long the proposed new track is, including its header */
+	trklen = 256;
+	for (n = 0; n < sectors; n++)
+	{
+		trklen += (128 << (track[4 * n + 3]));
+	}
+/* 4. Work out if this length is suitable */
+	if (!memcmp(hdr, "EXTENDED", 8))
+	{
+		fdc_byte *b = hdr + 0x34;
+
+		ext = 1;
+		if (trkno >= FDD_MAX_TRACKS) 	/* No room in the header */
+		{
+			memcpy(hdr, oldhead, 256);
+			return FD_E_READONLY;
+		}
+		img_trklen = (b[trkno] * 256) + 256;
+		if (trklen > img_trklen && b[trkno])
+		{
+			memcpy(hdr, oldhead, 256);
+			return FD_E_READONLY;
+		}
+		if (!b[trkno] && trkno > 0 && !b[trkno - 1])
+		{
+			memcpy(hdr, oldhead, 256);
+			return FD_E_READONLY;
+		}
+		trkoff = fdm->fdm_trkoff[trkno];
+		/* Store the length of the new track */
+		if (!b[trkno])
+		{
+			b[trkno] = (trklen >> 8) - 1;
+			fdm_index_tracks(fdm, trkno);
+		}
+	}
+	else
+	{
+		img_trklen = hdr[0x32] + 256 * hdr[0x33];
+		/* If no tracks formatted, or just the one track, length can
+		 * be what we like */
+		if ( (hdr[0x30] == 0) || (hdr[0x30] == 1 && hdr[0x31] == 1) )
+		{
+			if (trklen > img_trklen)
+			{
+				hdr[0x32] = trklen & 0xFF;
+				hdr[0x33] = (trklen >> 8);
+				img_trklen = trklen;
+			}
+		}
+		if (trklen > img_trklen)
+		{
+			memcpy(hdr, oldhead, 256);
+			return FD_E_READONLY;
+		}
+		trkoff = 256 + ((long)trkno * img_trklen);
+	}
+/* 5. Make sure the file is big enough. As with DSK drives, we do NOT
+ * double-step while formatting */
+	if (trkoff + trklen > fdm->fdm_size)
+	{
+		if (fdm_grow(fdm, trkoff + trklen))
+		{
+			if (fdm->fdm_map)
+			{
+				memcpy(fdm->fdm_map, oldhead, 256);
+				fdm_index_tracks(fdm, 0);
+			}
+			return FD_E_READONLY;
+		}
+		hdr = fdm->fdm_map;
+	}
+/* 6. Generate the Track-Info block and the sectors in place */
+	trkhead = hdr + trkoff;
+	memset(trkhead, 0, 256);
+	strcpy((char *)trkhead, "Track-Info\r\n");
+
+	trkhead[0x10] = fd->fd_cylinder;
+	trkhead[0x11] = head;
+	trkhead[0x14] = track[3];
+	trkhead[0x15] = sectors;
+	trkhead[0x16] = track[2];
+	trkhead[0x17] = filler;
+	for (n = 0; n < sectors; n++)
+	{
+		trkhead[0x18 + 8*n] = track[4*n];
+		trkhead[0x19 + 8*n] = track[4*n+1];
+		trkhead[0x1A + 8*n] = track[4*n+2];
+		trkhead[0x1B + 8*n] = track[4*n+3];
+		if (ext)
+		{
+			seclen = 128 << track[4 * n + 3];
+			trkhead[0x1E + 8 * n] = seclen & 0xFF;
+			trkhead[0x1F + 8 * n] = seclen >> 8;
+		}
+	}
+	memset(trkhead + 256, filler, trklen - 256);
+	fdm->fdm_dirty = 1;
+
+	if (fd->fd_cylinder >= hdr[0x30])
+	{
+		hdr[0x30] = fd->fd_cylinder + 1;
+	}
+	return FD_E_OK;
+}
+
+
+static int fdm_dirty(FLOPPY_DRIVE *fd)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+	return fdm->fdm_dirty ? FD_D_DIRTY : FD_D_CLEAN;
+}
+
+
+/* Start writing changes back to the DSK file */
+static void fdm_flush(FLOPPY_DRIVE *fd)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+	if (fdm->fdm_map) msync(fdm->fdm_map, fdm->fdm_size, MS_ASYNC);
+}
+
+
+/* Eject a DSK - write it back, unmap and close it */
+static void fdm_eject(FLOPPY_DRIVE *fd)
+{
+	MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+	if (fdm->fdm_map) msync(fdm->fdm_map, fdm->fdm_size, MS_SYNC);
+	fdm_close(fdm);
+	fdm_reset(fd);
+}
+
+
+static FLOPPY_DRIVE_VTABLE fdv_mdsk =
+{
+	fdm_seek_cylinder,
+	fdm_read_id,
+	fdm_read_sector,
+	fdm_read_track,
+	fdm_write_sector,
+	fdm_format_track,
+	fdd_drive_status,
+	fdm_isready,
+	fdm_dirty,
+	fdm_eject,
+	NULL,
+	fdm_reset,
+	fdm_eject,	/* Destroy: unmap and close */
+	NULL,
+	fdm_flush
+};
+
+/* Initialise a mapped DSK drive */
+FDRV_PTR fd_newmdsk(void)
+{
+	FDRV_PTR p = fd_inew(sizeof(MDSK_FLOPPY_DRIVE));
+
+	p->fd_vtable = &fdv_mdsk;
+	fd_reset(p);
+	((MDSK_FLOPPY_DRIVE *)p)->fdm_dirty = 0;
+	return p;
+}
+
+
+/* Get / set DSK file associated with this drive.
+ * Note that doing fdm_setfilename() causes an implicit eject on the
+ * previous disc in the drive. */
+char *   fdm_getfilename(FDRV_PTR fd)
+{
+	if (fd->fd_vtable == &fdv_mdsk)
+	{
+		return ((MDSK_FLOPPY_DRIVE *)fd)->fdm_filename;
+	}
+	return "Called fdm_getfilename() on wrong drive type";
+}
+
+void     fdm_setfilename(FDRV_PTR fd, const char *s)
+{
+	if (fd->fd_vtable == &fdv_mdsk)
+	{
+		MDSK_FLOPPY_DRIVE *fdm = (MDSK_FLOPPY_DRIVE *)fd;
+
+		fd_eject(fd);
+		strncpy(fdm->fdm_filename, s, sizeof(fdm->fdm_filename) - 1);
+		fdm->fdm_filename[sizeof(fdm->fdm_filename) - 1] = 0;
+		fdm->fdm_dirty = 0;
+	}
+}
@@ -0,0 +1,486 @@
+/* 765: Library to emulate the uPD765a floppy controller (aka Intel 8272)
+
+    Copyright (C) 2000  John Elliott <jce@seasip.demon.co.uk>
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Library General Public
+    License as published by the Free Software Foundation; either
+    version 2 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Library General Public License for more details.
+
+    You should have received a copy of the GNU Library General Public
+    License along with this library; if not, write to the Free
+    Software Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+
+*/
+
+/* A drive which emulates discs using raw images: just the sector data,
+ * track after track (cylinder 0 head 0, cylinder 0 head 1, ...), with no
+ * headers. As nothing in the file says what the disc looks like, the
+ * geometry has to be given. Every track has the same sectors, numbered
+ * upwards from the first sector ID, and the image is mapped into memory
+ * so a sector is found by one calculation. */
+
+#include "765i.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+extern fdc_byte fdd_drive_status(FLOPPY_DRIVE *fd);
+
+/* 720k: 80 cylinders, 2 heads, 9 512-byte sectors numbered from 1 */
+static const FD_GEOMETRY fdr_default_geom = { 80, 2, 9, 512, 1 };
+
+
+/* Reset variables: No image loaded. Called on eject and on initialisation */
+static void fdr_reset(FLOPPY_DRIVE *fd)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+	fdr->fdr_filename[0] = 0;
+	fdr->fdr_fd          = -1;
+	fdr->fdr_rdonly      = 0;
+	fdr->fdr_map         = NULL;
+	fdr->fdr_size        = 0;
+}
+
+
+/* Unmap and close the image */
+static void fdr_close(RAW_FLOPPY_DRIVE *fdr)
+{
+	if (fdr->fdr_map) munmap(fdr->fdr_map, fdr->fdr_size);
+	if (fdr->fdr_fd >= 0) close(fdr->fdr_fd);
+	fdr->fdr_map = NULL;
+	fdr->fdr_fd  = -1;
+}
+
+
+/* Map the first "size" bytes of the open image */
+static int fdr_map_file(RAW_FLOPPY_DRIVE *fdr, long size)
+{
+	void *p;
+	int prot = PROT_READ;
+
+	fdr->fdr_map  = NULL;
+	fdr->fdr_size = 0;
+	if (!size) return 0;	/* Blank: nothing formatted yet */
+
+	if (!fdr->fdr_rdonly) prot |= PROT_WRITE;
+	p = mmap(NULL, size, prot, MAP_SHARED, fdr->fdr_fd, 0);
+	if (p == MAP_FAILED)
+	{
+		fdc_dprintf(0, "Could not map %s.\n", fdr->fdr_filename);
+		return -1;
+	}
+	fdr->fdr_map  = p;
+	fdr->fdr_size = size;
+	return 0;
+}
+
+
+/* Return 1 if this drive is ready, else 0
+ * Attempts to open and map the image, and must therefore be called before
+ * any attempted image access. */
+static int fdr_isready(FLOPPY_DRIVE *fd)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	struct stat st;
+
+	if (!fd->fd_motor) return 0;	/* Motor is not running */
+
+	if (fdr->fdr_fd >= 0) return 1;		 /* Image is open and OK */
+	if (fdr->fdr_filename[0] == 0) return 0; /* No filename */
+
+	fdr->fdr_fd = open(fdr->fdr_filename, O_RDWR);
+	if (fdr->fdr_fd < 0)
+	{
+		fdr->fdr_fd = open(fdr->fdr_filename, O_RDONLY);
+		if (fdr->fdr_fd >= 0)
+		{
+			fd->fd_readonly = 1;	/* Read-only drive */
+			fdr->fdr_rdonly = 1;
+			fdc_dprintf(0, "Could only open %s read-only.\n",
+					fdr->fdr_filename);
+		}
+		else fdc_dprintf(0, "Could not open %s.\n", fdr->fdr_filename);
+	}
+	if (fdr->fdr_fd < 0)
+	{
+		fdr_reset(fd);
+		return 0;
+	}
+	if (fstat(fdr->fdr_fd, &st) || fdr_map_file(fdr, st.st_size))
+	{
+		fdc_dprintf(0, "Could not load image: %s\n", fdr->fdr_filename);
+		fdr_close(fdr);
+		fdr_reset(fd);
+		return 0;
+	}
+	return 1;
+}
+
+
+/* The cylinder of the image under the head. If this is a 3" or 5.25"
+ * drive with >= 80 tracks and the image has < 44, double-step. */
+static int fdr_cylinder(RAW_FLOPPY_DRIVE *fdr, int cylinder)
+{
+	if ((fdr->fdr.fd_type == FD_30 || fdr->fdr.fd_type == FD_525) &&
+	    fdr->fdr_geom.fg_cylinders < 44 && fdr->fdr.fd_cylinders >= 80)
+	{
+		cylinder /= 2;
+	}
+	return cylinder;
+}
+
+
+/* Offset in the image of a track */
+static long fdr_track_offset(RAW_FLOPPY_DRIVE *fdr, int head)
+{
+	FD_GEOMETRY *g = &fdr->fdr_geom;
+	long track = fdr_cylinder(fdr, fdr->fdr.fd_cylinder);
+
+	track = track * g->fg_heads + head;
+	return track * g->fg_sectors * g->fg_secsize;
+}
+
+
+/* The sector size code (N) for the geometry */
+static int fdr_secsize_code(RAW_FLOPPY_DRIVE *fdr)
+{
+	int n = 0;
+
+	while ((128 << n) < fdr->fdr_geom.fg_secsize && n < 7) n++;
+	return n;
+}
+
+
+/* Check the current track exists, and that its whole length has been
+ * formatted (ie is in the file) */
+static fd_err_t fdr_check_track(RAW_FLOPPY_DRIVE *fdr, int head)
+{
+	FD_GEOMETRY *g = &fdr->fdr_geom;
+	long end;
+
+	if (fdr->fdr_fd < 0) return FD_E_NOTRDY;
+	if (head >= g->fg_heads || head >= fdr->fdr.fd_heads)
+		return FD_E_NOADDR;
+	if (fdr_cylinder(fdr, fdr->fdr.fd_cylinder) >= g->fg_cylinders)
+		return FD_E_NOADDR;
+	end = fdr_track_offset(fdr, head) + (long)g->fg_sectors * g->fg_secsize;
+	if (end > fdr->fdr_size) return FD_E_NOADDR;
+	return 0;
+}
+
+
+/* Seek to a cylinder. Checks if that particular cylinder exists. */
+static fd_err_t fdr_seek_cylinder(FLOPPY_DRIVE *fd, int cylinder)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+	fdc_dprintf(4, "fdr_seek_cylinder: cylinder=%d\n",cylinder);
+
+	if (fdr->fdr_fd < 0) return FD_E_NOTRDY;
+	if (cylinder > fd->fd_cylinders) return FD_E_SEEKFAIL;
+	if (fdr_cylinder(fdr, cylinder) >= fdr->fdr_geom.fg_cylinders)
+		return FD_E_SEEKFAIL;
+
+	fd->fd_cylinder = cylinder;
+	return 0;
+}
+
+
+/* Read a sector ID from the current track. They are all made up from the
+ * geometry. */
+static fd_err_t fdr_read_id(FLOPPY_DRIVE *fd, int head, int sector, fdc_byte *buf)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	fd_err_t err = fdr_check_track(fdr, head);
+
+	if (err) return err;
+	buf[0] = fdr_cylinder(fdr, fd->fd_cylinder);
+	buf[1] = head;
+	buf[2] = fdr->fdr_geom.fg_secbase + (sector % fdr->fdr_geom.fg_sectors);
+	buf[3] = fdr_secsize_code(fdr);
+	return 0;
+}
+
+
+/* Find a given head & sector in the current cylinder, and return a pointer
+ * to its data in the mapping. Check that "xhead" and "xcylinder" match the
+ * sector's ID. */
+static fd_err_t fdr_seekto_sector(RAW_FLOPPY_DRIVE *fdr, int xcylinder,
+		int xhead, int head, int sector, fdc_byte **data, int *len)
+{
+	FD_GEOMETRY *g = &fdr->fdr_geom;
+	fd_err_t err = fdr_check_track(fdr, head);
+	int cyl = fdr_cylinder(fdr, fdr->fdr.fd_cylinder);
+
+	if (err) return err;
+	sector -= g->fg_secbase;
+	if (sector < 0 || sector >= g->fg_sectors)
+		return FD_E_NOSECTOR;	/* Sector not found */
+	if (xcylinder != cyl || xhead != head)
+	{
+		fdc_dprintf(0, "FDC: Looking for cyl=%d head=%d but found "
+		    "cyl=%d head=%d\n", xcylinder, xhead, cyl, head);
+		return FD_E_NOSECTOR;
+	}
+	if (g->fg_secsize != *len)
+	{
+		err = FD_E_DATAERR;
+		if (g->fg_secsize < *len) *len = g->fg_secsize;
+	}
+	*data = fdr->fdr_map + fdr_track_offset(fdr, head) +
+		(long)sector * g->fg_secsize;
+	return err;
+}
+
+
+/* Read a sector. Raw images can't hold deleted data, so a read for deleted
+ * data always finds the wrong kind. */
+static fd_err_t fdr_read_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+		int head,  int sector, fdc_byte *buf, int len,
+		int *deleted, int skip_deleted, int mfm, int multi)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	int rdeleted = (deleted && *deleted);
+	fdc_byte *data;
+	fd_err_t err;
+
+	fdc_dprintf(4, "fdr_read_sector: Expected cyl=%d head=%d sector=%d\n",
+			xcylinder, xhead, sector);
+
+	err = fdr_seekto_sector(fdr, xcylinder, xhead, head, sector,
+				&data, &len);
+	if (err != FD_E_DATAERR && err != FD_E_OK) return err;
+	if (rdeleted && skip_deleted) return FD_E_NODATA;
+	if (deleted) *deleted = rdeleted;
+	memcpy(buf, data, len);
+	return err;
+}
+
+
+/* Read a track */
+static fd_err_t fdr_read_track(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+		int head,  fdc_byte *buf, int *len)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	FD_GEOMETRY *g = &fdr->fdr_geom;
+	int trklen = g->fg_sectors * g->fg_secsize;
+	int seclen = g->fg_secsize;
+	fdc_byte *data;
+	fd_err_t err;
+
+	fdc_dprintf(4, "fdr_read_track: Expected cyl=%d head=%d\n",
+			xcylinder, xhead);
+
+	err = fdr_seekto_sector(fdr, xcylinder, xhead, head, g->fg_secbase,
+				&data, &seclen);
+	if (err) return err;
+	if (trklen != *len)
+	{
+		err = FD_E_DATAERR;
+		if (trklen > *len) trklen = *len;
+	}
+	memcpy(buf, data, trklen);
+	return err;
+}
+
+
+/* Write a sector. The deleted data mark is lost. */
+static fd_err_t fdr_write_sector(FLOPPY_DRIVE *fd, int xcylinder, int xhead,
+			int head, int sector, fdc_byte *buf, int len,
+			int deleted, int skip_deleted, int mfm, int multi)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	fdc_byte *data;
+	fd_err_t err;
+
+	fdc_dprintf(4, "fdr_write_sector: Expected cyl=%d head=%d sector=%d\n",
+			xcylinder, xhead, sector);
+
+	err = fdr_seekto_sector(fdr, xcylinder, xhead, head, sector,
+				&data, &len);
+
+	if (fd->fd_readonly || fdr->fdr_rdonly) return FD_E_READONLY;
+	if (err == FD_E_DATAERR || err == 0)
+	{
+		memcpy(data, buf, len);
+		fdr->fdr_dirty = 1;
+	}
+	return err;
+}
+
+
+/* Format a track. Only the layout the geometry describes can be written
+ * (in any order), and formatting past the end of the image extends it. */
+static fd_err_t fdr_format_track(FLOPPY_DRIVE *fd, int head,
+		int sectors, fdc_byte *track, fdc_byte filler)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	FD_GEOMETRY *g = &fdr->fdr_geom;
+	int n, cyl, code;
+	long trkoff, end, oldsize;
+
+	fdc_dprintf(4, "fdr_format_track: head=%d sectors=%d\n",
+			head, sectors);
+
+	if (fdr->fdr_fd < 0) return FD_E_NOTRDY;
+	if (fd->fd_readonly || fdr->fdr_rdonly) return FD_E_READONLY;
+
+	/* As with DSK drives, we do NOT double-step while formatting */
+	cyl  = fd->fd_cylinder;
+	code = fdr_secsize_code(fdr);
+	if (cyl >= g->fg_cylinders || head >= g->fg_heads ||
+	    sectors != g->fg_sectors) return FD_E_READONLY;
+	for (n = 0; n < sectors; n++)
+	{
+		if (track[4*n+2] < g->fg_secbase ||
+		    track[4*n+2] >= g->fg_secbase + g->fg_sectors ||
+		    track[4*n+3] != code) return FD_E_READONLY;
+	}
+
+	trkoff = ((long)cyl * g->fg_heads + head) * g->fg_sectors * g->fg_secsize;
+	end    = trkoff + (long)g->fg_sectors * g->fg_secsize;
+	if (end > fdr->fdr_size)
+	{
+		oldsize = fdr->fdr_size;
+		if (fdr->fdr_map) munmap(fdr->fdr_map, fdr->fdr_size);
+		if (ftruncate(fdr->fdr_fd, end) || fdr_map_file(fdr, end))
+		{
+			fdc_dprintf(0, "Could not extend %s.\n", fdr->fdr_filename);
+			if (fdr_map_file(fdr, oldsize))
+			{
+				fdr_close(fdr);
+				fdr_reset(fd);
+			}
+			return FD_E_READONLY;
+		}
+	}
+	memset(fdr->fdr_map + trkoff, filler, end - trkoff);
+	fdr->fdr_dirty = 1;
+	return FD_E_OK;
+}
+
+
+static int fdr_dirty(FLOPPY_DRIVE *fd)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+	return fdr->fdr_dirty ? FD_D_DIRTY : FD_D_CLEAN;
+}
+
+
+/* Start writing changes back to the image */
+static void fdr_flush(FLOPPY_DRIVE *fd)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+	if (fdr->fdr_map) msync(fdr->fdr_map, fdr->fdr_size, MS_ASYNC);
+}
+
+
+/* Eject a disc - write it back, unmap and close it */
+static void fdr_eject(FLOPPY_DRIVE *fd)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+	if (fdr->fdr_map) msync(fdr->fdr_map, fdr->fdr_size, MS_SYNC);
+	fdr_close(fdr);
+	fdr_reset(fd);
+}
+
+
+static FLOPPY_DRIVE_VTABLE fdv_raw =
+{
+	fdr_seek_cylinder,
+	fdr_read_id,
+	fdr_read_sector,
+	fdr_read_track,
+	fdr_write_sector,
+	fdr_format_track,
+	fdd_drive_status,
+	fdr_isready,
+	fdr_dirty,
+	fdr_eject,
+	NULL,
+	fdr_reset,
+	fdr_eject,	/* Destroy: unmap and close */
+	NULL,
+	fdr_flush
+};
+
+/* Initialise a raw image drive */
+FDRV_PTR fd_newraw(void)
+{
+	FDRV_PTR p = fd_inew(sizeof(RAW_FLOPPY_DRIVE));
+
+	p->fd_vtable = &fdv_raw;
+	fd_reset(p);
+	((RAW_FLOPPY_DRIVE *)p)->fdr_geom  = fdr_default_geom;
+	((RAW_FLOPPY_DRIVE *)p)->fdr_dirty = 0;
+	return p;
+}
+
+
+/* Get / set the image file associated with this drive.
+ * Note that doing fdr_setfilename() causes an implicit eject on the
+ * previous disc in the drive. */
+char *   fdr_getfilename(FDRV_PTR fd)
+{
+	if (fd->fd_vtable == &fdv_raw)
+	{
+		return ((RAW_FLOPPY_DRIVE *)fd)->fdr_filename;
+	}
+	return "Called fdr_getfilename() on wrong drive type";
+}
+
+void     fdr_setfilename(FDRV_PTR fd, const char *s)
+{
+	if (fd->fd_vtable == &fdv_raw)
+	{
+		RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+
+		fd_eject(fd);
+		strncpy(fdr->fdr_filename, s, sizeof(fdr->fdr_filename) - 1);
+		fdr->fdr_filename[sizeof(fdr->fdr_filename) - 1] = 0;
+		fdr->fdr_dirty = 0;
+	}
+}
+
+
+/* Get / set the geometry of the image. Sector sizes must be 128 << n,
+ * n = 0 to 7. Changing the geometry ejects the disc, as the image now
+ * means something else. Returns -1 if the geometry is no good. */
+void     fdr_getgeometry(FDRV_PTR fd, FD_GEOMETRY *g)
+{
+	if (fd->fd_vtable == &fdv_raw)
+	{
+		*g = ((RAW_FLOPPY_DRIVE *)fd)->fdr_geom;
+	}
+}
+
+int      fdr_setgeometry(FDRV_PTR fd, const FD_GEOMETRY *g)
+{
+	RAW_FLOPPY_DRIVE *fdr = (RAW_FLOPPY_DRIVE *)fd;
+	char name[PATH_MAX];
+	int n;
+
+	if (fd->fd_vtable != &fdv_raw) return -1;
+
+	for (n = 0; n < 8; n++) if (g->fg_secsize == (128 << n)) break;
+	if (n == 8 || g->fg_cylinders < 1 || g->fg_heads < 1 ||
+	    g->fg_heads > 2 || g->fg_sectors < 1 || g->fg_secbase < 0 ||
+	    g->fg_secbase + g->fg_sectors > 256) return -1;
+
+	strcpy(name, fdr->fdr_filename);
+	fdr_setfilename(fd, "");
+	fdr->fdr_geom = *g;
+	fdr_setfilename(fd, name);
+	return 0;
+}
@@ -1,29 +1,113 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
 #include "ide.h"
 
-int main(int argc, const char *argv[])
+static void usage(const char *p)
 {
-  int t, fd;
-  if (argc != 3) {
-    fprintf(stderr, "%s [type] [path]\n", argv[0]);
+  fprintf(stderr, "%s [-s] [-p] {type | -m megabytes | -g cyls:heads:sectors} path\n", p);
+  exit(1);
+}
+
+static void progress(uint32_t done, uint32_t total)
+{
+  static int last = -1;
+  int pct = (uint64_t)done * 100 / total;
+  if (pct == last)
+    return;
+  last = pct;
+  fprintf(stderr, "\r%u/%uMB %d%%", done / 2048, total / 2048, pct);
+  if (done == total)
+    fputc('\n', stderr);
+}
+
+int main(int argc, char *argv[])
+{
+  int t = 0, fd, opt;
+  int sparse = 0;
+  int custom = 0;
+  unsigned int c = 0, h = 0, s = 0;
+  uint32_t lba = 0;
+  unsigned long mb;
+  int r;
+  struct timespec start, end;
+  struct stat st;
+  double secs;
+
+  while ((opt = getopt(argc, argv, "g:m:ps")) != -1) {
+    switch (opt) {
+      case 'g':
+        if (sscanf(optarg, "%u:%u:%u", &c, &h, &s) != 3 ||
+            c > 65535 || h > 16 || s > 255)
+          usage(argv[0]);
+        custom = 1;
+        break;
+      case 'm':
+        mb = strtoul(optarg, NULL, 0);
+        if (mb == 0 || mb > IDE_LBA28_MAX / 2048) {
+          fprintf(stderr, "%s: size must be 1 to %u MB.\n", argv[0],
+                  IDE_LBA28_MAX / 2048);
+          exit(1);
+        }
+        lba = mb * 2048;
+        custom = 1;
+        break;
+      case 'p':
+        ide_make_progress = progress;
+        break;
+      case 's':
+        sparse = 1;
+        break;
+      default:
+        usage(argv[0]);
+    }
+  }
+  if (custom) {
+    if (argc - optind != 1)
+      usage(argv[0]);
+  } else {
+    if (argc - optind != 2)
+      usage(argv[0]);
+    t = atoi(argv[optind++]);
+    if (t < 1 || t > MAX_DRIVE_TYPE) {
+      fprintf(stderr, "%s: unknown drive type.\n", argv[0]);
+      exit(1);
+    }
+  }
+  fd = open(argv[optind], O_WRONLY|O_TRUNC|O_CREAT|O_EXCL, 0666);
+  if (fd == -1) {
+    perror(argv[optind]);
     exit(1);
   }
-  t = atoi(argv[1]);
-  if (t < 1 || t > MAX_DRIVE_TYPE) {
-    fprintf(stderr, "%s: unknown drive type.\n", argv[0]);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (custom)
+    r = ide_make_custom(fd, lba, c, h, s, sparse);
+  else if (sparse)
+    r = ide_make_sparse(t, fd);
+  else
+    r = ide_make_drive(t, fd);
+  if (r == -2) {
+    fprintf(stderr, "%s: invalid geometry.\n", argv[0]);
+    unlink(argv[optind]);
     exit(1);
   }
-  fd = open(argv[2], O_WRONLY|O_TRUNC|O_CREAT|O_EXCL, 0666);
-  if (fd == -1) {
-    perror(argv[2]);
+  if (r < 0) {
+    perror(argv[optind]);
     exit(1);
   }
-  if (ide_make_drive(t, fd) < 0) {
-    perror(argv[2]);
+  if (close(fd) == -1 || stat(argv[optind], &st) == -1) {
+    perror(argv[optind]);
     exit(1);
   }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  printf("%s: %lldK in %.2fs", argv[optind], (long long)st.st_size / 1024, secs);
+  if (secs > 0)
+    printf(" (%.1fMB/s)", st.st_size / secs / 1048576);
+  printf("\n");
   return 0;
 }
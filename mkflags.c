@@ -0,0 +1,182 @@
+/*
+ *	Generate the flag lookup tables used by the 8085 emulator. The
+ *	calculations here are the same ones the emulator used to do at run
+ *	time (including the undocumented V and K behaviour) so the tables
+ *	give identical results.
+ *
+ *	Each table entry holds every flag the operation sets. Bit 3 is never
+ *	included, and for INR/DCR neither is the carry, as those are
+ *	preserved from the previous flags.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+
+static uint8_t flags;
+
+static void flag_if(uint8_t f, int c)
+{
+	if (c)
+		flags |= f;
+	else
+		flags &= ~f;
+}
+
+static int parity(uint8_t v)
+{
+	int p = 1;
+	while (v) {
+		p ^= v & 1;
+		v >>= 1;
+	}
+	return p;
+}
+
+static void calc_SZP(uint8_t value)
+{
+	flags &= 0x3B;
+	flags |= (value & 0x80) | (value ? 0 : 0x40) | (parity(value) << 2);
+}
+
+static void calc_AC(uint8_t val1, uint8_t val2)
+{
+	flag_if(0x10, ((val1 & 0x0F) + (val2 & 0x0F)) > 0x0F);
+}
+
+static void calc_AC_carry(uint8_t val1, uint8_t val2)
+{
+	flag_if(0x10, ((val1 & 0x0F) + (val2 & 0x0F)) >= 0x0F);
+}
+
+static void calc_subAC(int8_t val1, uint8_t val2)
+{
+	flag_if(0x10, (val2 & 0x0F) <= (val1 & 0x0F));
+}
+
+static void calc_subAC_borrow(int8_t val1, uint8_t val2)
+{
+	flag_if(0x10, (val2 & 0x0F) < (val1 & 0x0F));
+}
+
+static void calc_Vadd(int8_t val1, int8_t val2, int c)
+{
+	uint8_t c6 = ((val1 & 0x7F) + (val2 & 0x7F) + c) & 0x80;
+	uint16_t c7 = ((uint16_t)val1 + val2 + c) & 0x100;
+	flag_if(0x02, (!!c6) ^ (!!c7));
+}
+
+static void calc_Vsub(int8_t val1, int8_t val2, int c)
+{
+	uint8_t c6 = ((val1 & 0x7F) - (val2 & 0x7F) - c) & 0x80;
+	uint16_t c7 = ((val1 - val2 - c) & 0x100) >> 1;
+	flag_if(0x02, c6 ^ c7);
+}
+
+static void calc_K(int8_t r)
+{
+	flag_if(0x20, (!!(flags & 0x02)) ^ !!(r & 0x80));
+}
+
+static uint8_t flags_add(uint8_t a, uint8_t b, uint8_t c)
+{
+	uint16_t temp16 = (uint16_t)a + (uint16_t)b + (uint16_t)c;
+	flags = 0;
+	if (c)
+		calc_AC_carry(a, b);
+	else
+		calc_AC(a, b);
+	calc_Vadd(a, b, c);
+	flag_if(0x01, temp16 & 0xFF00);
+	calc_SZP((uint8_t)temp16);
+	calc_K(temp16);
+	return flags;
+}
+
+static uint8_t flags_sub(uint8_t a, uint8_t b, uint8_t c)
+{
+	uint16_t temp16 = (uint16_t)a - (uint16_t)b - (uint16_t)c;
+	flags = 0;
+	if (c)
+		calc_subAC_borrow(a, b);
+	else
+		calc_subAC(a, b);
+	calc_Vsub(a, b, c);
+	flag_if(0x01, ((temp16 & 0x00FF) >= a) && (b | c));
+	calc_SZP((uint8_t)temp16);
+	calc_K(temp16);
+	return flags;
+}
+
+static uint8_t flags_inr(uint8_t a)
+{
+	flags = 0;
+	calc_AC(a, 1);
+	calc_SZP(a + 1);
+	flag_if(0x02, a == 0x7F);
+	calc_K(a + 1);
+	return flags;
+}
+
+static uint8_t flags_dcr(uint8_t a)
+{
+	flags = 0;
+	calc_subAC(a, 1);
+	calc_SZP(a - 1);
+	flag_if(0x02, a == 0x80);
+	calc_K(a - 1);
+	return flags;
+}
+
+/* Result of a logic operation: AC, C and V clear, K is S ^ V */
+static uint8_t flags_logic(uint8_t a)
+{
+	flags = 0;
+	calc_SZP(a);
+	calc_K(a);
+	return flags;
+}
+
+static uint8_t flags_szp(uint8_t a)
+{
+	flags = 0;
+	calc_SZP(a);
+	return flags;
+}
+
+static void table(const char *name, uint8_t (*fn)(uint8_t))
+{
+	unsigned int i;
+
+	printf("static const uint8_t %s[0x100] = {", name);
+	for (i = 0; i < 0x100; i++)
+		printf("%s0x%02X,", (i & 15) ? " " : "\n\t", fn(i));
+	printf("\n};\n\n");
+}
+
+static void table2(const char *name, uint8_t (*fn)(uint8_t, uint8_t, uint8_t))
+{
+	unsigned int c, i;
+
+	printf("static const uint8_t %s[2][0x10000] = {\n", name);
+	for (c = 0; c < 2; c++) {
+		printf("{");
+		for (i = 0; i < 0x10000; i++)
+			printf("%s0x%02X,", (i & 15) ? " " : "\n\t",
+				fn(i >> 8, i & 0xFF, c));
+		printf("\n},\n");
+	}
+	printf("};\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+	printf("/* Generated by mkflags - do not edit */\n\n");
+	table("szp_flags", flags_szp);
+	table("logic_flags", flags_logic);
+	table("inr_flags", flags_inr);
+	table("dcr_flags", flags_dcr);
+	/* Indexed by [carry/borrow in][a << 8 | b] */
+	table2("add_flags", flags_add);
+	table2("sub_flags", flags_sub);
+	return 0;
+}
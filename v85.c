@@ -30,6 +30,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include "intel_8085_emulator.h"
 #include "ide.h"
 #include "765.h"
@@ -49,9 +53,103 @@ static FDRV_PTR drive_a, drive_b, drive_c;
 
 
 /* We do 6MHz so 6,000,000 tstates a second. That works out at 30,000 per
-   5ms working period, each of which we split 200 ways */
+   5ms working period */
 
-static uint16_t tstate_steps = 150;
+#define TSTATES_PERIOD	30000
+
+/*
+ *	Device timing is driven by events queued against the emulated T-state
+ *	clock. The CPU runs without interruption until the earliest event is
+ *	due. Events posted from within an I/O handler that fall inside the
+ *	current CPU run cut it short.
+ */
+struct event {
+	uint64_t when;
+	void (*fn)(void);
+	int slot;		/* Position in the queue, -1 if not queued */
+};
+
+#define EVENT_MAX	16
+
+static uint64_t tstates;	/* Emulated time */
+static uint64_t slice_end;	/* End of the current CPU run */
+static struct event *eventq[EVENT_MAX];
+static unsigned int nevent;
+
+/* The current time. tstates only moves on between CPU runs so I/O
+   handlers called part way through one must add what the CPU has used */
+static uint64_t now(void)
+{
+	return tstates + i8085_elapsed();
+}
+
+static void event_swap(unsigned int a, unsigned int b)
+{
+	struct event *e = eventq[a];
+	eventq[a] = eventq[b];
+	eventq[b] = e;
+	eventq[a]->slot = a;
+	eventq[b]->slot = b;
+}
+
+static void event_up(unsigned int n)
+{
+	while (n && eventq[(n - 1) / 2]->when > eventq[n]->when) {
+		event_swap(n, (n - 1) / 2);
+		n = (n - 1) / 2;
+	}
+}
+
+static void event_down(unsigned int n)
+{
+	unsigned int c;
+
+	while ((c = 2 * n + 1) < nevent) {
+		if (c + 1 < nevent && eventq[c + 1]->when < eventq[c]->when)
+			c++;
+		if (eventq[n]->when <= eventq[c]->when)
+			break;
+		event_swap(n, c);
+		n = c;
+	}
+}
+
+/* Schedule an event. If it is already queued it is only ever brought
+   forward */
+static void event_at(struct event *e, uint64_t when)
+{
+	if (e->slot != -1) {
+		if (when >= e->when)
+			return;
+		e->when = when;
+		event_up(e->slot);
+	} else {
+		if (nevent == EVENT_MAX) {
+			fprintf(stderr, "v85: event queue full.\n");
+			exit(1);
+		}
+		e->when = when;
+		e->slot = nevent;
+		eventq[nevent++] = e;
+		event_up(e->slot);
+	}
+	if (when < slice_end)
+		i8085_yield();
+}
+
+/* Run everything that is due */
+static void event_run(void)
+{
+	struct event *e;
+
+	while (nevent && eventq[0]->when <= tstates) {
+		e = eventq[0];
+		event_swap(0, --nevent);
+		event_down(0);
+		e->slot = -1;
+		e->fn();
+	}
+}
 
 #define TRACE_MEM	1
 #define TRACE_IO	2
@@ -67,6 +165,36 @@ static uint16_t tstate_steps = 150;
 static int trace = 0;
 
 
+/*
+ *	Memory is mapped through a table of 256 byte pages so that the usual
+ *	access is a single lookup. A NULL entry sends the access down the slow
+ *	path which handles ROM writes and tracing. The map is rebuilt when
+ *	the bank or the trace setting changes.
+ */
+static uint8_t *rpage[256];
+static uint8_t *wpage[256];
+
+static void mem_map(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < 256; i++) {
+		if (i >= 0xC0)
+			rpage[i] = baseram + ((i & 0x3F) << 8);
+		else if (banknum == 8)	/* ROM */
+			rpage[i] = rom + ((i & 1) << 8);
+		else
+			rpage[i] = bankram[banknum] + (i << 8);
+		wpage[i] = rpage[i];
+		if (i < 0xC0 && banknum == 8)
+			wpage[i] = NULL;
+		if (trace & TRACE_MEM)
+			rpage[i] = wpage[i] = NULL;
+	}
+	/* Let the CPU code cache know what is mapped */
+	i8085_set_bank(banknum, 0xC000);
+}
+
 uint8_t i8085_debug_read(uint16_t addr)
 {
 	uint8_t *p = bankram[banknum] + addr;
@@ -77,20 +205,23 @@ uint8_t i8085_debug_read(uint16_t addr)
 	return *p;
 }
 
-uint8_t i8085_read(uint16_t addr)
+static uint8_t mem_read_slow(uint16_t addr)
 {
-	uint8_t *p = bankram[banknum] + addr;
-	if (addr >= 0xC000)
-		p = baseram + (addr & 0x3FFF);
-	else if (banknum == 8) 	/* ROM */
-		p = rom + (addr & 0x1FF);
+	uint8_t r = i8085_debug_read(addr);
 	if (trace & TRACE_MEM)
-		fprintf(stderr, "R[%d] %04X = %02X\n", banknum, addr, *p);
-	return *p;
+		fprintf(stderr, "R[%d] %04X = %02X\n", banknum, addr, r);
+	return r;
 }
 
+uint8_t i8085_read(uint16_t addr)
+{
+	uint8_t *p = rpage[addr >> 8];
+	if (p)
+		return p[addr & 0xFF];
+	return mem_read_slow(addr);
+}
 
-void i8085_write(uint16_t addr, uint8_t val)
+static void mem_write_slow(uint16_t addr, uint8_t val)
 {
 	uint8_t *p = bankram[banknum] + addr;
 	if (addr >= 0xC000)
@@ -106,6 +237,15 @@ void i8085_write(uint16_t addr, uint8_t val)
 		fprintf(stderr, "W%d %04X = %02X\n", banknum, addr, val);
 }
 
+void i8085_write(uint16_t addr, uint8_t val)
+{
+	uint8_t *p = wpage[addr >> 8];
+	if (p)
+		p[addr & 0xFF] = val;
+	else
+		mem_write_slow(addr, val);
+}
+
 /* We don't currently use the RIM/SIM driven GPIO pins */
 
 int i8085_get_input(void)
@@ -117,36 +257,223 @@ void i8085_set_output(int val)
 {
 }
 
-static int check_chario(void)
+/*
+ *	Console I/O is done by a separate thread so that the CPU never makes
+ *	a system call for console traffic. Bytes pass each way through a
+ *	single producer, single consumer ring.
+ */
+#define RING_SIZE	4096	/* Must be a power of two */
+
+struct ring {
+	atomic_uint head;	/* Only written by the producer */
+	atomic_uint tail;	/* Only written by the consumer */
+	uint8_t buf[RING_SIZE];
+};
+
+static struct ring rx_ring, tx_ring;
+static atomic_int console_sleeping;
+static atomic_int console_quit;
+static int console_pipe[2];
+static pthread_t console_tid;
+
+static unsigned int ring_used(struct ring *r)
+{
+	return atomic_load(&r->head) - atomic_load(&r->tail);
+}
+
+static int ring_put(struct ring *r, uint8_t c)
+{
+	unsigned int h = atomic_load_explicit(&r->head, memory_order_relaxed);
+	if (h - atomic_load(&r->tail) == RING_SIZE)
+		return 0;
+	r->buf[h & (RING_SIZE - 1)] = c;
+	atomic_store(&r->head, h + 1);
+	return 1;
+}
+
+static int ring_get(struct ring *r, uint8_t *c)
+{
+	unsigned int t = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	if (atomic_load(&r->head) == t)
+		return 0;
+	*c = r->buf[t & (RING_SIZE - 1)];
+	atomic_store(&r->tail, t + 1);
+	return 1;
+}
+
+/* Wake the console thread if it is waiting for something to do */
+static void console_wake(void)
 {
-	fd_set i, o;
-	struct timeval tv;
-	unsigned int r = 0;
+	if (atomic_exchange(&console_sleeping, 0))
+		if (write(console_pipe[1], "", 1) == -1)
+			perror("console_wake");
+}
 
-	FD_ZERO(&i);
-	FD_SET(0, &i);
-	FD_ZERO(&o);
-	FD_SET(1, &o);
-	tv.tv_sec = 0;
-	tv.tv_usec = 0;
+/* Send whatever is queued for output in as few writes as possible */
+static void console_flush_tx(void)
+{
+	unsigned int t, n;
+	ssize_t r;
+
+	while ((n = ring_used(&tx_ring)) != 0) {
+		t = atomic_load_explicit(&tx_ring.tail, memory_order_relaxed);
+		t &= RING_SIZE - 1;
+		if (n > RING_SIZE - t)
+			n = RING_SIZE - t;
+		r = write(1, tx_ring.buf + t, n);
+		if (r <= 0) {
+			if (r == -1 && errno == EINTR)
+				continue;
+			/* Output has gone away: discard it */
+			r = n;
+		}
+		atomic_fetch_add(&tx_ring.tail, r);
+	}
+}
 
-	if (select(2, &i, NULL, NULL, &tv) == -1) {
-		if (errno == EINTR)
-			return 0;
-		perror("select");
+/* Read what input there is room for. Returns 0 on end of file */
+static int console_fill_rx(void)
+{
+	unsigned int h, n;
+	ssize_t r;
+
+	h = atomic_load_explicit(&rx_ring.head, memory_order_relaxed);
+	n = RING_SIZE - ring_used(&rx_ring);
+	h &= RING_SIZE - 1;
+	if (n > RING_SIZE - h)
+		n = RING_SIZE - h;
+	r = read(0, rx_ring.buf + h, n);
+	if (r == 0 || (r == -1 && errno != EINTR && errno != EAGAIN))
+		return 0;
+	if (r > 0)
+		atomic_fetch_add(&rx_ring.head, r);
+	return 1;
+}
+
+static void *console_thread(void *unused)
+{
+	struct pollfd pfd[2];
+	int rx_eof = 0;
+	int rx_full;
+	char junk[64];
+
+	for (;;) {
+		console_flush_tx();
+		if (atomic_load(&console_quit))
+			break;
+		/* Say we are going to sleep, then check nothing arrived in
+		   the meantime */
+		atomic_store(&console_sleeping, 1);
+		if (ring_used(&tx_ring) || atomic_load(&console_quit)) {
+			atomic_store(&console_sleeping, 0);
+			continue;
+		}
+		rx_full = ring_used(&rx_ring) == RING_SIZE;
+		pfd[0].fd = (rx_eof || rx_full) ? -1 : 0;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = console_pipe[0];
+		pfd[1].events = POLLIN;
+		/* If the input ring is full we look again shortly */
+		poll(pfd, 2, rx_full ? 10 : -1);
+		atomic_store(&console_sleeping, 0);
+		if (pfd[1].revents & POLLIN)
+			if (read(console_pipe[0], junk, sizeof(junk)) == -1)
+				perror("console");
+		if (pfd[0].fd != -1 && (pfd[0].revents & (POLLIN | POLLHUP)))
+			rx_eof = !console_fill_rx();
+	}
+	return NULL;
+}
+
+static void console_stop(void);
+
+static void console_start(void)
+{
+	sigset_t set, old;
+
+	if (pipe(console_pipe) == -1) {
+		perror("pipe");
 		exit(1);
 	}
-	if (FD_ISSET(0, &i))
-		r |= 1;
-	if (FD_ISSET(1, &o))
-		r |= 2;
-	return r;
+	/* Leave the signals to the main thread */
+	sigemptyset(&set);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGQUIT);
+	sigaddset(&set, SIGPIPE);
+	pthread_sigmask(SIG_BLOCK, &set, &old);
+	if (pthread_create(&console_tid, NULL, console_thread, NULL)) {
+		fprintf(stderr, "v85: unable to create console thread.\n");
+		exit(1);
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	/* Output still in the ring must not be lost if we exit early */
+	atexit(console_stop);
+}
+
+/* Finish sending any output and stop the console thread. Safe to call
+   more than once */
+static void console_stop(void)
+{
+	if (atomic_exchange(&console_quit, 1))
+		return;
+	console_wake();
+	pthread_join(console_tid, NULL);
+}
+
+/*
+ *	Output flushing policy. By default each byte is passed on at once.
+ *	For line and buffer modes output is held until a newline (line mode
+ *	only), until the ring is half full, until it has been waiting for
+ *	FLUSH_DELAY, or when the guest looks to be waiting for input.
+ */
+#define FLUSH_CHAR	0
+#define FLUSH_LINE	1
+#define FLUSH_BUFFER	2
+
+#define FLUSH_DELAY	(TSTATES_PERIOD * 10)	/* 50ms */
+#define FLUSH_IDLE	16	/* Status polls without output = waiting */
+
+static uint8_t flush_policy = FLUSH_CHAR;
+static unsigned int console_idle;
+
+static void console_flush_event(void);
+static struct event console_flush_ev = { 0, console_flush_event, -1 };
+
+static void console_flush_event(void)
+{
+	if (ring_used(&tx_ring))
+		console_wake();
+}
+
+static void console_put(uint8_t c)
+{
+	/* The ACIA doesn't report ready when the ring is full, but not all
+	   software checks */
+	while (!ring_put(&tx_ring, c)) {
+		console_wake();
+		sched_yield();
+	}
+	console_idle = 0;
+	if (flush_policy == FLUSH_CHAR || ring_used(&tx_ring) >= RING_SIZE / 2 ||
+		(flush_policy == FLUSH_LINE && c == '\n'))
+		console_wake();
+	else
+		event_at(&console_flush_ev, now() + FLUSH_DELAY);
+}
+
+/* The guest is polling the console status. If it keeps doing so without
+   sending anything it is most likely waiting for input, so make sure it
+   can be seen what it is waiting for */
+static void console_poll(void)
+{
+	if (console_idle < FLUSH_IDLE && ++console_idle == FLUSH_IDLE)
+		console_flush_event();
 }
 
 static unsigned int next_char(void)
 {
-	char c;
-	if (read(0, &c, 1) != 1) {
+	uint8_t c;
+	if (!ring_get(&rx_ring, &c)) {
 		printf("(tty read without ready byte)\n");
 		return 0xFF;
 	}
@@ -198,20 +525,41 @@ static void acia_transmit(void)
 	}
 }
 
-static void acia_timer(void)
+/* How often we look for console input, and how long the transmitter
+   takes to be ready again after a write */
+#define ACIA_POLL	1500
+#define ACIA_TX_TIME	150
+
+static void acia_rx_event(void);
+static void acia_tx_event(void);
+
+static struct event acia_rx_ev = { 0, acia_rx_event, -1 };
+static struct event acia_tx_ev = { 0, acia_tx_event, -1 };
+
+static void acia_rx_event(void)
 {
-	int s = check_chario();
-	if (s & 1)
+	if (ring_used(&rx_ring)) {
 		acia_receive();
-	if (s & 2)
-		acia_transmit();
-	if (s)
 		acia_irq_compute();
+	}
+	event_at(&acia_rx_ev, tstates + ACIA_POLL);
+}
+
+static void acia_tx_event(void)
+{
+	/* Not ready until the console has room for more */
+	if (ring_used(&tx_ring) == RING_SIZE) {
+		event_at(&acia_tx_ev, tstates + ACIA_TX_TIME);
+		return;
+	}
+	acia_transmit();
+	acia_irq_compute();
 }
 
 /* Very crude for initial testing ! */
 static uint8_t acia_read(uint8_t addr)
 {
+	addr &= 1;
 	if (trace & TRACE_ACIA)
 		fprintf(stderr, "acia_read %d ", addr);
 	switch (addr) {
@@ -223,6 +571,8 @@ static uint8_t acia_read(uint8_t addr)
 		 */
 		acia_status &= ~0x80;
 		acia_inint = 0;
+		if (!(acia_status & 1))
+			console_poll();
 		if (trace & TRACE_ACIA)
 			fprintf(stderr, "acia_status %d\n", acia_status);
 		return acia_status;
@@ -238,8 +588,9 @@ static uint8_t acia_read(uint8_t addr)
 	}
 }
 
-static void acia_write(uint16_t addr, uint8_t val)
+static void acia_write(uint8_t addr, uint8_t val)
 {
+	addr &= 1;
 	if (trace & TRACE_ACIA)
 		fprintf(stderr, "acia_write %d %d\n", addr, val);
 	switch (addr) {
@@ -255,10 +606,11 @@ static void acia_write(uint16_t addr, uint8_t val)
 		acia_irq_compute();
 		return;
 	case 1:
-		write(1, &val, 1);
+		console_put(val);
 		/* Clear any existing int state and tx empty */
 		acia_status &= ~0x82;
 		acia_irq_compute();
+		event_at(&acia_tx_ev, now() + ACIA_TX_TIME);
 		break;
 	}
 }
@@ -269,14 +621,14 @@ static void acia_write(uint16_t addr, uint8_t val)
  */
 struct ide_controller *ide0;
 
-static uint8_t my_ide_read(uint16_t addr)
+static uint8_t my_ide_read(uint8_t addr)
 {
-	return ide_read8(ide0, addr);
+	return ide_read8(ide0, addr & 7);
 }
 
-static void my_ide_write(uint16_t addr, uint8_t val)
+static void my_ide_write(uint8_t addr, uint8_t val)
 {
-	ide_write8(ide0, addr, val);
+	ide_write8(ide0, addr & 7, val);
 }
 
 /*
@@ -362,6 +714,7 @@ static int i8237_cycle(struct i8237 *dmac, int chan)
 		/* Memory to memory, dest: process here */
 		if (chan == 1 && (dmac->command & 1)) {
 			i8085_write(c->car, dmac->temp);
+			i8085_code_invalidate(c->car);
 			i8237_inc(c);
 			i8237_count(dmac, chan, c);
 			return 4;
@@ -391,6 +744,7 @@ static int i8237_cycle(struct i8237 *dmac, int chan)
 		break;
 	case 0x08:
 		i8085_write(c->car, fdc_read_data(fdc));
+		i8085_code_invalidate(c->car);
 		break;
 	case 0x0C:
 		/* Chained - invalid */
@@ -402,9 +756,10 @@ static int i8237_cycle(struct i8237 *dmac, int chan)
 }
 
 /* Run the DMA engine whilst there is work to do */
+/* Returns the number of cycles of DMA activity */
 static int i8237_execute(int ncycl)
 {
-	int cycles;
+	int cycles, total = 0;
 
 	if ((fdc_read_ctrl(fdc) & 0x90) == 0x90)
 		i8237_fdc_dma = 1;
@@ -418,8 +773,33 @@ static int i8237_execute(int ncycl)
 		cycles += i8237_cycle(&i8237, 1);
 		cycles += i8237_cycle(&i8237, 2);
 		cycles += i8237_cycle(&i8237, 3);
-	} while (cycles && cycles < ncycl);
-	return ncycl - cycles;
+		total += cycles;
+	} while (cycles && total < ncycl);
+	return total;
+}
+
+/*
+ *	The DMA engine is run as an event. It keeps itself scheduled whilst it
+ *	has work to do and is otherwise kicked by the CPU accessing the DMA
+ *	controller or the FDC. The cycles it uses hold the CPU off the bus.
+ */
+#define DMA_SLICE	150
+
+static void dma_event(void);
+static struct event dma_ev = { 0, dma_event, -1 };
+
+static void dma_event(void)
+{
+	int used = i8237_execute(DMA_SLICE);
+	if (used) {
+		tstates += used;
+		event_at(&dma_ev, tstates + DMA_SLICE - used);
+	}
+}
+
+static void dma_kick(void)
+{
+	event_at(&dma_ev, now());
 }
 
 static uint8_t i8237_read(uint8_t addr)
@@ -464,6 +844,8 @@ static void i8237_write(uint8_t addr, uint8_t val)
 {
 	struct i8237_channel *c = i8237.chan + ((addr >> 1) & 0x03);
 
+	dma_kick();
+
 	switch(addr & 0x0F) {
 		case 0x00:
 		case 0x02:
@@ -543,6 +925,7 @@ static uint8_t fdc_ctrl;
 
 static uint8_t fdc_read(uint8_t addr)
 {
+	dma_kick();
 	switch(addr & 0x03) {
 	case 0:
 		return fdc_read_data(fdc);
@@ -556,6 +939,7 @@ static uint8_t fdc_read(uint8_t addr)
 
 static void fdc_write(uint8_t addr, uint8_t val)
 {
+	dma_kick();
 	addr &= 3;
 	switch(addr) {
 	case 0:
@@ -818,12 +1202,12 @@ static void msm5832_tick(void)
 static uint8_t timer_val;
 static uint8_t timer_count;
 
-static uint8_t timer_read(void)
+static uint8_t timer_read(uint8_t addr)
 {
 	return timer_val;
 }
 
-static void timer_write(uint8_t val)
+static void timer_write(uint8_t addr, uint8_t val)
 {
 	timer_val = val;
 	if (timer_val & 0x50)
@@ -840,7 +1224,21 @@ static void timer_tick(void)
 		i8085_set_int(INT_RST65);
 }
 
-static void bank_write(uint8_t bank)
+/* Change the trace settings and switch the memory map and CPU loop to
+   match */
+static void trace_set(int val)
+{
+	trace = val;
+	i8085_log = (trace & TRACE_CPU) ? stderr : NULL;
+	/* Memory tracing wants to see the instruction fetches */
+	i8085_code_cache(!(trace & TRACE_MEM));
+	mem_map();
+	/* The CPU loop is picked on entry to i8085_exec, so end the slice
+	   to switch now */
+	i8085_yield();
+}
+
+static void bank_write(uint8_t addr, uint8_t bank)
 {
 	if (trace & TRACE_BANK)
 		fprintf(stderr, "Bank select %02X\n", bank);
@@ -880,62 +1278,164 @@ static void bank_write(uint8_t bank)
 	}
 	if (!(bank & bankmap))
 		banknum = 8;
+	mem_map();
 }
 
-uint8_t i8085_inport(uint8_t addr)
+static void trace_write(uint8_t addr, uint8_t val)
+{
+	printf("trace set to %d\n", val);
+	trace_set(val);
+}
+
+/*
+ *	I/O ports are dispatched through a table of per port handlers. Each
+ *	device claims its ports with io_register() at start up and the
+ *	handlers are passed the full port number.
+ */
+typedef uint8_t (*io_read_t)(uint8_t addr);
+typedef void (*io_write_t)(uint8_t addr, uint8_t val);
+
+static uint8_t io_unknown_read(uint8_t addr)
 {
-	if (trace & TRACE_IO)
-		fprintf(stderr, "read %02x\n", addr);
-	if (addr >= 0x00 && addr <= 0x01)
-		return acia_read(addr & 1);
-	if (addr >= 0x10 && addr <= 0x17)
-		return my_ide_read(addr & 7);
-	if (addr >= 0x18 && addr <= 0x1f)
-		return fdc_read(addr);
-	if (addr >= 0x20 && addr <= 0x2F)
-		return i8237_read(addr);
-	if (addr >= 0xC6 && addr <= 0xC7)
-		return mdrive_read(addr);
-	if (addr >= 0xE0 && addr <= 0xE3)
-		return alt256_read(addr);
-	if (addr >= 0xF0 && addr <= 0xF1)
-		return msm5832_read(addr);
-	if (addr == 0xFE)
-		timer_read();
 	if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown read from port %02X\n", addr);
 	return 0xFF;
 }
 
-void i8085_outport(uint8_t addr, uint8_t val)
+static void io_unknown_write(uint8_t addr, uint8_t val)
 {
-	if (trace & TRACE_IO)
-		fprintf(stderr, "write %02x <- %02x\n", addr, val);
-	if (addr >= 0x00 && addr <= 0x01)
-		acia_write(addr & 1, val);
-	else if (addr >= 0x10 && addr <= 0x17)
-		my_ide_write(addr & 7, val);
-	else if (addr >= 0x18 && addr <= 0x1F)
-		fdc_write(addr, val);
-	else if (addr >= 0x20 && addr <= 0x2F)
-		i8237_write(addr, val);
-	else if (addr == 0x40)
-		bank_write(val);
-	else if (addr >= 0xC6 && addr <= 0xC7)
-		mdrive_write(addr, val);
-	else if (addr >= 0xE0 && addr <= 0xE3)
-		alt256_write(addr, val);
-	else if (addr >= 0xF0 && addr <= 0xF1)
-		msm5832_write(addr, val);
-	else if (addr == 0xFD) {
-		printf("trace set to %d\n", val);
-		trace = val;
-	} else if (addr == 0xFE) {
-		timer_write(val);
-	} else if (trace & TRACE_UNK)
+	if (trace & TRACE_UNK)
 		fprintf(stderr, "Unknown write to port %04X of %02X\n", addr, val);
 }
 
+static io_read_t io_rd[256];
+static io_write_t io_wr[256];
+
+/* A NULL handler leaves that direction unclaimed */
+static void io_register(uint8_t base, unsigned int count, io_read_t rd,
+			io_write_t wr)
+{
+	unsigned int i;
+
+	for (i = base; i < base + count && i < 256; i++) {
+		io_rd[i] = rd ? rd : io_unknown_read;
+		io_wr[i] = wr ? wr : io_unknown_write;
+	}
+}
+
+static void io_init(void)
+{
+	io_register(0x00, 256, NULL, NULL);
+	io_register(0x00, 2, acia_read, acia_write);
+	io_register(0x10, 8, my_ide_read, my_ide_write);
+	io_register(0x18, 8, fdc_read, fdc_write);
+	io_register(0x20, 16, i8237_read, i8237_write);
+	io_register(0x40, 1, NULL, bank_write);
+	io_register(0xC6, 2, mdrive_read, mdrive_write);
+	io_register(0xE0, 4, alt256_read, alt256_write);
+	io_register(0xF0, 2, msm5832_read, msm5832_write);
+	io_register(0xFD, 1, NULL, trace_write);
+	io_register(0xFE, 1, timer_read, timer_write);
+}
+
+/*
+ *	The port accessors are instantiated with and without the trace check
+ *	so that normal running only tests trace once per access.
+ */
+static inline uint8_t io_read(uint8_t addr, int tr)
+{
+	if (tr && (trace & TRACE_IO))
+		fprintf(stderr, "read %02x\n", addr);
+	return io_rd[addr](addr);
+}
+
+static inline void io_write(uint8_t addr, uint8_t val, int tr)
+{
+	if (tr && (trace & TRACE_IO))
+		fprintf(stderr, "write %02x <- %02x\n", addr, val);
+	io_wr[addr](addr, val);
+}
+
+uint8_t i8085_inport(uint8_t addr)
+{
+	if (trace)
+		return io_read(addr, 1);
+	return io_read(addr, 0);
+}
+
+void i8085_outport(uint8_t addr, uint8_t val)
+{
+	if (trace)
+		io_write(addr, val, 1);
+	else
+		io_write(addr, val, 0);
+}
+
+/*
+ *	Real time pacing. Each period is 5ms - it's a balance between nice
+ *	behaviour and simulation smoothness.
+ */
+#define PERIOD_NS	5000000L
+#define MAX_LAG_NS	100000000L	/* Give up catching up after 100ms */
+
+static struct timespec pace;
+
+static void wait_period(struct timespec *next)
+{
+	struct timespec now;
+	long lag;
+
+	next->tv_nsec += PERIOD_NS;
+	if (next->tv_nsec >= 1000000000L) {
+		next->tv_nsec -= 1000000000L;
+		next->tv_sec++;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	lag = (now.tv_sec - next->tv_sec) * 1000000000L +
+		now.tv_nsec - next->tv_nsec;
+	/* Ahead: sleep until the deadline */
+	if (lag < 0) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next,
+			NULL) == EINTR && !done);
+		return;
+	}
+	/* Behind: return at once so we run the next period straight away,
+	   unless we are so far behind (stopped, suspended, very slow host)
+	   that it is better to just carry on from now */
+	if (lag > MAX_LAG_NS)
+		*next = now;
+}
+
+/* The 5ms housekeeping: keep in step with real time and run the slow
+   timers */
+static void period_event(void);
+static struct event period_ev = { 0, period_event, -1 };
+
+static void period_event(void)
+{
+	if (!fast)
+		wait_period(&pace);
+	timer_tick();
+	msm5832_tick();
+	alt256_tick();
+	event_at(&period_ev, tstates + TSTATES_PERIOD);
+}
+
+/* The floppy drives hold changes in memory (cached tracks or a mapping of
+   the image) and write them back lazily. Push any changes out to the
+   image files about once a second */
+#define FLOPPY_FLUSH	(TSTATES_PERIOD * 200)
+
+static void floppy_flush_event(void);
+static struct event floppy_flush_ev = { 0, floppy_flush_event, -1 };
+
+static void floppy_flush_event(void)
+{
+	fd_flush(drive_a);
+	fd_flush(drive_b);
+	event_at(&floppy_flush_ev, tstates + FLOPPY_FLUSH);
+}
+
 static struct termios saved_term, term;
 
 static void cleanup(int sig)
@@ -948,35 +1448,141 @@ static void exit_cleanup(void)
 	tcsetattr(0, TCSADRAIN, &saved_term);
 }
 
+/* Dirty floppy tracks are held in memory between flushes, so write them
+   back if we exit other than from the end of main (a bad instruction or a
+   fatal device error) */
+static void floppy_exit(void)
+{
+	fd_flush(drive_a);
+	fd_flush(drive_b);
+}
+
+/* Likewise the IDE write back cache, which the guest only empties with a
+   FLUSH CACHE */
+static void ide_exit(void)
+{
+	if (ide0 && ide_flush(ide0))
+		fprintf(stderr, "v85: ide flush failed.\n");
+}
+
+/* A 5.25" 80 track double sided drive holding name.dsk, or failing that
+   the raw image name.img laid out as described by raw (or the library
+   default if NULL). If there is neither the slot is empty. With map set
+   a .DSK image is mapped into memory rather than read and written through
+   stdio */
+static FDRV_PTR floppy_new(const char *name, int map, const FD_GEOMETRY *raw)
+{
+	FDRV_PTR d;
+	char path[32];
+
+	snprintf(path, sizeof(path), "%s.dsk", name);
+	if (access(path, 0) == 0) {
+		d = map ? fd_newmdsk() : fd_newdsk();
+		fd_settype(d, FD_525);
+		fd_setheads(d, 2);
+		fd_setcyls(d, 80);
+		if (map)
+			fdm_setfilename(d, path);
+		else
+			fdd_setfilename(d, path);
+		return d;
+	}
+	snprintf(path, sizeof(path), "%s.img", name);
+	if (access(path, 0))
+		return fd_new();
+	d = fd_newraw();
+	fd_settype(d, FD_525);
+	fd_setheads(d, 2);
+	fd_setcyls(d, 80);
+	if (raw && fdr_setgeometry(d, raw)) {
+		fprintf(stderr, "v85: bad floppy geometry.\n");
+		exit(EXIT_FAILURE);
+	}
+	fdr_setfilename(d, path);
+	return d;
+}
+
 static void usage(void)
 {
-	fprintf(stderr, "v85: [-b banks] [-f] [-d debug]\n");
+	fprintf(stderr, "v85: [-b banks] [-f] [-m] [-r readahead] [-c cachesectors [-w]]\n"
+			"     [-O overlay [-e commit|discard]] [-M] [-g cyls:heads:sectors:size:first]\n"
+			"     [-d debug] [-o char|line|buffer]\n");
 	exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-	static struct timespec tc;
 	int opt;
 	int fd;
-	int cycles;
-
-	while ((opt = getopt(argc, argv, "b:d:f")) != -1) {
+	int n;
+	int ide_map = 0;
+	int ide_ra = 0;
+	int ide_cache = 0;
+	int ide_wb = 0;
+	char *overlay = NULL;
+	int overlay_exit = 0;	/* 1 commit, 2 discard */
+	int fd_map = 0;
+	FD_GEOMETRY raw_geom, *raw = NULL;
+
+	while ((opt = getopt(argc, argv, "b:c:d:e:fg:mo:r:wMO:")) != -1) {
 		switch (opt) {
 		case 'b':
 			bankmap = atoi(optarg) | 1;
 			break;
+		case 'c':
+			ide_cache = atoi(optarg);
+			break;
 		case 'd':
 			trace = atoi(optarg);
 			break;
+		case 'e':
+			if (strcmp(optarg, "commit") == 0)
+				overlay_exit = 1;
+			else if (strcmp(optarg, "discard") == 0)
+				overlay_exit = 2;
+			else
+				usage();
+			break;
 		case 'f':
 			fast = 1;
 			break;
+		case 'g':
+			if (sscanf(optarg, "%d:%d:%d:%d:%d", &raw_geom.fg_cylinders,
+				&raw_geom.fg_heads, &raw_geom.fg_sectors,
+				&raw_geom.fg_secsize, &raw_geom.fg_secbase) != 5)
+				usage();
+			raw = &raw_geom;
+			break;
+		case 'm':
+			ide_map = 1;
+			break;
+		case 'r':
+			ide_ra = atoi(optarg);
+			break;
+		case 'w':
+			ide_wb = 1;
+			break;
+		case 'M':
+			fd_map = 1;
+			break;
+		case 'O':
+			overlay = optarg;
+			break;
+		case 'o':
+			if (strcmp(optarg, "char") == 0)
+				flush_policy = FLUSH_CHAR;
+			else if (strcmp(optarg, "line") == 0)
+				flush_policy = FLUSH_LINE;
+			else if (strcmp(optarg, "buffer") == 0)
+				flush_policy = FLUSH_BUFFER;
+			else
+				usage();
+			break;
 		default:
 			usage();
 		}
 	}
-	if (optind < argc)
+	if (optind < argc || (overlay && ide_map) || (overlay_exit && !overlay))
 		usage();
 
 	fd = open("v85.rom", O_RDONLY);
@@ -990,15 +1596,34 @@ int main(int argc, char *argv[])
 	}
 	close(fd);
 
+	if (ide_cache_init(ide_cache, ide_wb)) {
+		fprintf(stderr, "v85: unable to allocate ide cache.\n");
+		exit(1);
+	}
 	ide0 = ide_allocate("cf");
 	if (ide0) {
-		int ide_fd = open("v85.ide", O_RDWR);
+		/* With an overlay the base image is only written by a commit */
+		int ide_fd = open("v85.ide", overlay && overlay_exit != 1 ? O_RDONLY : O_RDWR);
 		if (ide_fd == -1) {
 			perror("v85.ide");
 			exit(1);
 		}
-		if (ide_attach(ide0, 0, ide_fd) == 0)
+		if (overlay) {
+			int cow_fd = open(overlay, O_RDWR | O_CREAT, 0600);
+			if (cow_fd == -1) {
+				perror(overlay);
+				exit(1);
+			}
+			n = ide_attach_cow(ide0, 0, ide_fd, cow_fd);
+		} else if (ide_map)
+			n = ide_attach_mmap(ide0, 0, ide_fd);
+		else
+			n = ide_attach(ide0, 0, ide_fd);
+		if (n == 0) {
+			ide_set_readahead(ide0, 0, ide_ra);
 			ide_reset_begin(ide0);
+		}
+		atexit(ide_exit);
 	} else {
 		fprintf(stderr, "v85: ide set up failed.\n");
 		exit(1);
@@ -1009,23 +1634,9 @@ int main(int argc, char *argv[])
 
 	lib765_register_error_function(fdc_log);
 
-	if (access("drivea.dsk", 0) == 0) {
-		drive_a = fd_newdsk();
-		fd_settype(drive_a, FD_525);
-		fd_setheads(drive_a, 2);
-		fd_setcyls(drive_a, 80);
-		fdd_setfilename(drive_a, "drivea.dsk");
-	} else
-		drive_a = fd_new();
-
-	if (access("driveb.dsk", 0) == 0) {
-		drive_b = fd_newdsk();
-		fd_settype(drive_a, FD_525);
-		fd_setheads(drive_a, 2);
-		fd_setcyls(drive_a, 80);
-		fdd_setfilename(drive_a, "driveb.dsk");
-	} else
-		drive_b = fd_new();
+	drive_a = floppy_new("drivea", fd_map, raw);
+	drive_b = floppy_new("driveb", fd_map, raw);
+	atexit(floppy_exit);
 
 	drive_c = fd_new();
 
@@ -1037,11 +1648,6 @@ int main(int argc, char *argv[])
 	fdc_setdrive(fdc, 2, drive_c);
 	fdc_setdrive(fdc, 3, drive_c);
 
-	/* 5ms - it's a balance between nice behaviour and simulation
-	   smoothness */
-	tc.tv_sec = 0;
-	tc.tv_nsec = 5000000L;
-
 	if (tcgetattr(0, &term) == 0) {
 		saved_term = term;
 		atexit(exit_cleanup);
@@ -1056,37 +1662,29 @@ int main(int argc, char *argv[])
 		term.c_cc[VSTOP] = 0;
 		tcsetattr(0, TCSADRAIN, &term);
 	}
+	console_start();
 
+	io_init();
+	trace_set(trace);
+	i8085_set_pages(rpage, wpage);
 	i8085_reset();
 
-	/* This is the wrong way to do it but it's easier for the moment. We
-	   should track how much real time has occurred and try to keep cycle
-	   matched with that. The scheme here works fine except when the host
-	   is loaded though */
-
-	/* We run 150 cycles per I/O check, do that 200 times then poll the
-	   slow stuff and nap for 5ms. */
+	/* Run the CPU up to the next event, then run the events. Every 5ms
+	   of emulated time we wait for the end of that 5ms of real time. The
+	   deadlines are absolute so time spent emulating is not added to the
+	   nap, and if the host falls behind we run periods back to back to
+	   catch up. */
 
-	cycles = tstate_steps;
-
-	if (trace & TRACE_CPU)
-		i8085_log = stderr;
+	clock_gettime(CLOCK_MONOTONIC, &pace);
+	event_at(&acia_rx_ev, 0);
+	event_at(&period_ev, TSTATES_PERIOD);
+	event_at(&floppy_flush_ev, FLOPPY_FLUSH);
 
 	while (!done) {
-		int i;
-		/* 30000 T states */
-		for (i = 0; i < 200; i++) {
-			cycles = tstate_steps + i8237_execute(cycles);
-			if (cycles >= 0)
-				cycles = tstate_steps + i8085_exec(cycles);
-			acia_timer();
-		}
-		/* Do 5ms of I/O and delays */
-		if (!fast)
-			nanosleep(&tc, NULL);
-		timer_tick();
-		msm5832_tick();
-		alt256_tick();
+		event_run();
+		slice_end = eventq[0]->when;
+		n = slice_end - tstates;
+		tstates += n - i8085_exec(n);
 	}
 	fd_eject(drive_a);
 	fd_eject(drive_b);
@@ -1095,5 +1693,19 @@ int main(int argc, char *argv[])
 	fd_destroy(&drive_a);
 	fd_destroy(&drive_b);
 	fd_destroy(&drive_c);
+	if (overlay_exit == 1 && ide_cow_commit(&ide0->drive[0]))
+		fprintf(stderr, "v85: overlay commit failed.\n");
+	if (ide_free(ide0))
+		fprintf(stderr, "v85: ide flush failed.\n");
+	ide0 = NULL;
+	if (overlay_exit == 2)
+		unlink(overlay);
+	console_stop();
+	if (ide_cache) {
+		unsigned long hits, misses;
+		ide_cache_stats(&hits, &misses);
+		fprintf(stderr, "v85: ide cache %lu hits, %lu misses.\n",
+			hits, misses);
+	}
 	exit(0);
 }